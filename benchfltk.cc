@@ -0,0 +1,207 @@
+/**** file guifltk-refpersys/benchfltk.cc ******
+ ****  SPDX-License-Identifier: MIT ******
+ *
+ * © Copyright 2023 The  Reflective Persistent System Team
+ * team@refpersys.org &   http://refpersys.org/
+ *
+ * contributors: Basile Starynkevitch <basile@starynkevitch.net>
+ *
+ **********************************************/
+
+#include "fltkrps.hh"
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+/* The --io-bench=<count> mode forks a fake RefPerSys, which sends
+ * <count> gui_version requests on a fresh FIFO pair and reads their
+ * replies, while this process serves them with the poll or io_uring
+ * backend like a real connection.  Only the thread running the event
+ * loop is measured, so the child and the setup are not counted.
+ * System calls are counted by the raw_syscalls:sys_enter tracepoint
+ * when perf_event_open allows it; otherwise do-io-benchmark.sh counts
+ * them with strace -c. */
+
+/// set by the --io-bench program option
+long io_bench_count;
+
+/// a perf counter of the system calls of the calling thread, or -1
+static int
+bench_syscall_counter(void)
+{
+    int id = -1;
+    for (const char*path: {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                           "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+                          })
+        {
+            FILE* fil = fopen(path, "r");
+            if (!fil)
+                continue;
+            if (fscanf(fil, "%d", &id) < 1)
+                id = -1;
+            fclose(fil);
+            if (id >= 0)
+                break;
+        };
+    if (id < 0)
+        return -1;
+    struct perf_event_attr pea;
+    memset (&pea, 0, sizeof(pea));
+    pea.type = PERF_TYPE_TRACEPOINT;
+    pea.size = sizeof(pea);
+    pea.config = id;
+    pea.disabled = 1;
+    pea.sample_period = 1;
+    return (int) syscall(SYS_perf_event_open, &pea, 0 /*this thread*/, -1, -1,
+                         PERF_FLAG_FD_CLOEXEC);
+} // end bench_syscall_counter
+
+/// the fake RefPerSys, in the child process
+static void
+bench_peer(const std::string& prefix, long count)
+{
+    /// the reader end is opened first, so the GUI can open it for writing
+    int outfd = open((prefix + ".out").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    int cmdfd = open((prefix + ".cmd").c_str(), O_WRONLY | O_CLOEXEC);
+    if (outfd < 0 || cmdfd < 0)
+        _exit(EXIT_FAILURE);
+    fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
+    std::string reqs;
+    long nbsent = 0, nbreplies = 0;
+    char buf[frps_read_size];
+    while (nbreplies < count)
+        {
+            if (reqs.empty() && nbsent < count)
+                for (long nb = 0; nb < 256 && nbsent < count; nb++)
+                    {
+                        nbsent++;
+                        reqs += "{\"jsonrpc\":\"2.0\",\"method\":\"gui_version\",\"id\":";
+                        reqs += std::to_string(nbsent);
+                        reqs += "}";
+                        reqs.push_back(frps_message_terminator);
+                    };
+            struct pollfd pfd[2];
+            pfd[0] = {outfd, POLLIN, 0};
+            pfd[1] = {cmdfd, POLLOUT, 0};
+            if (poll(pfd, reqs.empty()?1:2, 10000) <= 0)
+                _exit(EXIT_FAILURE);
+            if (pfd[0].revents & (POLLIN|POLLHUP))
+                {
+                    ssize_t nb = read(outfd, buf, sizeof(buf));
+                    if (nb == 0 && (pfd[0].revents & POLLHUP))
+                        _exit(EXIT_FAILURE);
+                    for (ssize_t ix = 0; ix < nb; ix++)
+                        if (buf[ix] == frps_message_terminator)
+                            nbreplies++;
+                };
+            if (!reqs.empty() && (pfd[1].revents & POLLOUT))
+                {
+                    ssize_t nb = write(cmdfd, reqs.data(), reqs.size());
+                    if (nb > 0)
+                        reqs.erase(0, nb);
+                };
+        };
+    /// closing the command FIFO gives an end of file to the GUI
+    _exit(EXIT_SUCCESS);
+} // end bench_peer
+
+int
+io_benchmark(long count)
+{
+    char dirbuf[] = "/tmp/guifltkrps-bench-XXXXXX";
+    if (!mkdtemp(dirbuf))
+        {
+            std::clog << progname << " cannot create benchmark directory :" << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        };
+    std::string prefix = std::string(dirbuf) + "/fifo";
+    if (mkfifo((prefix + ".cmd").c_str(), 0600) || mkfifo((prefix + ".out").c_str(), 0600))
+        {
+            std::clog << progname << " cannot create benchmark FIFOs :" << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        };
+    if (use_io_uring && !iouring_start())
+        use_io_uring = false;
+    connection_st* conn = new connection_st(vector_connections.size(), prefix);
+    vector_connections.push_back(conn);
+    /// the command FIFO must have its reader before the child opens it
+    if (!conn->open_fifos())
+        return EXIT_FAILURE;
+    fflush(nullptr);
+    pid_t pid = fork();
+    if (pid < 0)
+        {
+            std::clog << progname << " cannot fork benchmark peer :" << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        };
+    if (pid == 0)
+        bench_peer(prefix, count);
+    while (conn->conn_state == CONNSTATE_WAITING)
+        Fl::wait(frps_reopen_delay);
+    int ctrfd = bench_syscall_counter();
+    struct rusage ru0, ru1;
+    memset (&ru0, 0, sizeof(ru0));
+    memset (&ru1, 0, sizeof(ru1));
+    io_stats_st stats0 = frps_io_stats;
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    getrusage(RUSAGE_THREAD, &ru0);
+    if (ctrfd >= 0)
+        {
+            ioctl(ctrfd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(ctrfd, PERF_EVENT_IOC_ENABLE, 0);
+        };
+    while (conn->conn_state != CONNSTATE_DISCONNECTED)
+        Fl::wait(1.0);
+    uint64_t nbsyscalls = 0;
+    if (ctrfd >= 0)
+        {
+            ioctl(ctrfd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(ctrfd, &nbsyscalls, sizeof(nbsyscalls)) != sizeof(nbsyscalls))
+                ctrfd = -1;
+        };
+    getrusage(RUSAGE_THREAD, &ru1);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    int childstatus = 0;
+    waitpid(pid, &childstatus, 0);
+    unlink((prefix + ".cmd").c_str());
+    unlink((prefix + ".out").c_str());
+    rmdir(dirbuf);
+    long nbmessages = frps_io_stats.ios_nb_messages - stats0.ios_nb_messages;
+    long nbbytes = frps_io_stats.ios_nb_inbytes - stats0.ios_nb_inbytes
+                   + frps_io_stats.ios_nb_outbytes - stats0.ios_nb_outbytes;
+    double cputime = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec)
+                     + 1.0e-6*(ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec)
+                     + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec)
+                     + 1.0e-6*(ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+    double walltime = (ts1.tv_sec - ts0.tv_sec) + 1.0e-9*(ts1.tv_nsec - ts0.tv_nsec);
+    double megabytes = nbbytes / (1024.0*1024.0);
+    char buf[256];
+    memset (buf, 0, sizeof(buf));
+    snprintf(buf, sizeof(buf),
+             "%ld messages, %ld bytes, %.3f s elapsed, %.3f CPU s in the event loop, %.3f CPU s/MB",
+             nbmessages, nbbytes, walltime, cputime, megabytes > 0.0 ? cputime / megabytes : 0.0);
+    std::cout << progname << " I/O benchmark with " << (use_io_uring?"io_uring":"poll")
+              << ", reads of " << frps_read_size << " bytes: " << buf << std::endl;
+    memset (buf, 0, sizeof(buf));
+    if (ctrfd >= 0)
+        snprintf(buf, sizeof(buf), "%ld syscalls, %.2f syscalls/message",
+                 (long)nbsyscalls, nbmessages ? (double)nbsyscalls / nbmessages : 0.0);
+    else
+        snprintf(buf, sizeof(buf), "syscalls not counted (no perf tracepoint), use do-io-benchmark.sh");
+    std::cout << progname << " I/O benchmark: " << buf << std::endl;
+    if (ctrfd >= 0)
+        close(ctrfd);
+    if (!WIFEXITED(childstatus) || WEXITSTATUS(childstatus) != 0 || nbmessages != count)
+        {
+            std::clog << progname << " I/O benchmark failed, got " << nbmessages
+                      << " of " << count << " messages" << std::endl;
+            return EXIT_FAILURE;
+        };
+    return EXIT_SUCCESS;
+} // end io_benchmark
+
+/// end of file benchfltk.cc
@@ -0,0 +1,429 @@
+/**** file guifltk-refpersys/checkfltk.cc ******
+ ****  SPDX-License-Identifier: MIT ******
+ *
+ * © Copyright 2023 The  Reflective Persistent System Team
+ * team@refpersys.org &   http://refpersys.org/
+ *
+ * contributors: Basile Starynkevitch <basile@starynkevitch.net>
+ *
+ **********************************************/
+
+#include "jsonrpsfltk.hh"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+
+/// most problems of one file are counted, but only that many are shown
+constexpr unsigned frps_check_max_shown = 8;
+
+/// a name given by symb_name somewhere in a persistore file
+struct check_name_st
+{
+    std::string cn_name;
+    int64_t cn_h0, cn_h1;
+    /// the UTF-8 character count given by the hash function
+    int cn_nbchars;
+};
+
+/// the result of checking one persistore file, filled by one worker
+struct check_file_st
+{
+    std::string cf_path;
+    std::string cf_base;
+    size_t cf_size;
+    long cf_nbvalues;
+    long cf_nbobjects;
+    /// the object count of the prologue, or -1 without it
+    long cf_declared;
+    double cf_millisec;
+    long cf_nberrors;
+    std::vector<std::string> cf_messages;
+    std::vector<std::string> cf_oids;
+    std::vector<check_name_st> cf_names;
+};
+
+static void
+check_report(check_file_st& cf, const std::string& msg)
+{
+    cf.cf_nberrors++;
+    if (cf.cf_messages.size() < frps_check_max_shown)
+        cf.cf_messages.push_back(msg);
+} // end check_report
+
+/// line number of some byte offset, for messages
+static long
+check_line(std::string_view text, size_t pos)
+{
+    if (pos > text.size())
+        pos = text.size();
+    return 1 + std::count(text.begin(), text.begin() + pos, '\n');
+} // end check_line
+
+static bool
+check_control_char(char c)
+{
+    return (uint8_t)c < 0x20 || c == 0x7f;
+} // end check_control_char
+
+static bool
+check_symbol_name(json_reader& rd, check_file_st& cf)
+{
+    size_t pos = rd.position();
+    check_name_st cn {std::string(), 0, 0, 0};
+    if (!rd.read_string(cn.cn_name))
+        return false;
+    cf.cf_nbvalues++;
+    int64_t ht[2] = {0,0};
+    /// the hash function counts characters but accepts any bytes, and
+    /// \u escapes may give invalid UTF-8 after the check of the file
+    const char*problem = nullptr;
+    if (cn.cn_name.empty())
+        problem = "empty symbol name";
+    else if (u8_check((const uint8_t*)cn.cn_name.data(), cn.cn_name.size()))
+        problem = "symbol name with invalid UTF-8";
+    else if (std::find_if(cn.cn_name.begin(), cn.cn_name.end(), check_control_char) != cn.cn_name.end())
+        problem = "symbol name with control character";
+    if (problem)
+        check_report(cf, std::string(problem) + " at line "
+                     + std::to_string(check_line(rd.text(), pos)));
+    else
+        cn.cn_nbchars = rps_compute_cstr_two_64bits_hash(ht, cn.cn_name.c_str(), cn.cn_name.size());
+    cn.cn_h0 = ht[0];
+    cn.cn_h1 = ht[1];
+    cf.cf_names.push_back(std::move(cn));
+    return true;
+} // end check_symbol_name
+
+static bool
+check_value(json_reader& rd, check_file_st& cf, int depth)
+{
+    if (depth > 256)
+        return rd.fail("too deeply nested");
+    cf.cf_nbvalues++;
+    std::string_view key;
+    switch (rd.peek())
+        {
+        case '{':
+            rd.begin_object();
+            while (rd.next_member(key))
+                {
+                    if (key == "symb_name" && rd.peek() == '"')
+                        {
+                            if (!check_symbol_name(rd, cf))
+                                return false;
+                        }
+                    else if (!check_value(rd, cf, depth+1))
+                        return false;
+                };
+            return rd.ok();
+        case '[':
+            rd.begin_array();
+            while (rd.next_element())
+                if (!check_value(rd, cf, depth+1))
+                    return false;
+            return rd.ok();
+        default:
+            return rd.skip_value();
+        };
+} // end check_value
+
+/// a top level object is a RefPerSys object if it has an oid, or the
+/// prologue if it has nbobjects
+static bool
+check_toplevel(json_reader& rd, check_file_st& cf)
+{
+    if (rd.peek() != '{')
+        return check_value(rd, cf, 0);
+    cf.cf_nbvalues++;
+    std::string_view key;
+    rd.begin_object();
+    while (rd.next_member(key))
+        {
+            if (key == "oid" && rd.peek() == '"')
+                {
+                    cf.cf_oids.emplace_back();
+                    if (!rd.read_string(cf.cf_oids.back()))
+                        return false;
+                    cf.cf_nbobjects++;
+                    cf.cf_nbvalues++;
+                }
+            else if (key == "nbobjects" && rd.peek() != '{' && rd.peek() != '[')
+                {
+                    int64_t nb = -1;
+                    if (!rd.read_int64(nb))
+                        return false;
+                    cf.cf_declared = nb;
+                    cf.cf_nbvalues++;
+                }
+            else if (key == "symb_name" && rd.peek() == '"')
+                {
+                    if (!check_symbol_name(rd, cf))
+                        return false;
+                }
+            else if (!check_value(rd, cf, 1))
+                return false;
+        };
+    return rd.ok();
+} // end check_toplevel
+
+static void
+check_one_file(check_file_st& cf)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    int fd = open(cf.cf_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        {
+            check_report(cf, std::string("cannot open: ") + strerror(errno));
+            return;
+        };
+    struct stat st;
+    memset (&st, 0, sizeof(st));
+    if (fstat(fd, &st))
+        {
+            check_report(cf, std::string("cannot stat: ") + strerror(errno));
+            close(fd);
+            return;
+        };
+    /// the file is mapped, not read, so the memory of a worker does not
+    /// grow with the biggest space file; its pages are read once, in order
+    size_t size = st.st_size;
+    void*ad = nullptr;
+    if (size > 0)
+        {
+            ad = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ad == MAP_FAILED)
+                {
+                    check_report(cf, std::string("cannot mmap: ") + strerror(errno));
+                    close(fd);
+                    return;
+                };
+            madvise(ad, size, MADV_SEQUENTIAL);
+        };
+    close(fd);
+    std::string_view content((const char*)ad, size);
+    cf.cf_size = content.size();
+    const uint8_t* badutf8 = u8_check((const uint8_t*)content.data(), content.size());
+    if (badutf8)
+        check_report(cf, "invalid UTF-8 at line "
+                     + std::to_string(check_line(content, badutf8 - (const uint8_t*)content.data())));
+    json_reader rd(content);
+    while (!rd.at_end() && check_toplevel(rd, cf))
+        continue;
+    if (!rd.ok())
+        check_report(cf, std::string("JSON error: ") + rd.error() + " at line "
+                     + std::to_string(check_line(content, rd.position())));
+    if (cf.cf_declared >= 0 && cf.cf_declared != cf.cf_nbobjects)
+        check_report(cf, "prologue declares " + std::to_string(cf.cf_declared)
+                     + " objects but " + std::to_string(cf.cf_nbobjects) + " were found");
+    if (ad)
+        munmap(ad, size);
+    cf.cf_millisec = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - t0).count();
+} // end check_one_file
+
+/// the space ids listed in the spaceset of the manifest
+static bool
+check_manifest(const std::string& manifpath, std::vector<std::string>& spaceids, long& nberrors)
+{
+    FILE* manif = fopen(manifpath.c_str(), "r");
+    if (!manif)
+        {
+            std::clog << progname << " cannot open manifest " << manifpath
+                      << " :" << strerror(errno) << std::endl;
+            nberrors++;
+            return false;
+        };
+    std::string content;
+    char buf[4*frps_buffer_size];
+    size_t nb = 0;
+    while ((nb = fread(buf, 1, sizeof(buf), manif)) > 0)
+        content.append(buf, nb);
+    fclose(manif);
+    if (u8_check((const uint8_t*)content.data(), content.size()))
+        {
+            std::clog << progname << " manifest " << manifpath << " is not valid UTF-8" << std::endl;
+            nberrors++;
+        };
+    json_reader rd(content);
+    std::string_view key;
+    bool gotspaceset = false;
+    if (rd.peek() != '{')
+        rd.fail("manifest is not a JSON object");
+    else
+        {
+            rd.begin_object();
+            while (rd.next_member(key))
+                {
+                    if (key != "spaceset" || rd.peek() != '[')
+                        {
+                            rd.skip_value();
+                            continue;
+                        };
+                    gotspaceset = true;
+                    rd.begin_array();
+                    while (rd.next_element())
+                        {
+                            spaceids.emplace_back();
+                            if (!rd.read_string(spaceids.back()))
+                                break;
+                        };
+                };
+        };
+    if (!rd.ok())
+        {
+            std::clog << progname << " bad manifest " << manifpath << ": " << rd.error()
+                      << " at line " << check_line(content, rd.position()) << std::endl;
+            nberrors++;
+            return false;
+        };
+    if (!gotspaceset)
+        std::clog << progname << " manifest " << manifpath
+                  << " has no spaceset, not cross-checked" << std::endl;
+    return gotspaceset;
+} // end check_manifest
+
+int
+check_persistore(const std::string& refpersysdir)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    long nberrors = 0;
+    std::string persistpath = refpersysdir + "/persistore";
+    DIR* persidir = opendir(persistpath.c_str());
+    if (!persidir)
+        {
+            std::clog << progname << " cannot open RefPerSys persistent store directory " << persistpath
+                      << " :" << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        };
+    std::vector<check_file_st> files;
+    struct dirent* ent = nullptr;
+    while ((ent = readdir(persidir)) != nullptr)
+        {
+            int nlen = strlen(ent->d_name);
+            if (ent->d_type == DT_REG && isalnum(ent->d_name[0])
+                    && nlen > 5 && !strcmp(ent->d_name+nlen-5, ".json"))
+                {
+                    files.emplace_back();
+                    check_file_st& cf = files.back();
+                    cf.cf_base = ent->d_name;
+                    cf.cf_path = persistpath + "/" + ent->d_name;
+                    cf.cf_size = 0;
+                    cf.cf_nbvalues = cf.cf_nbobjects = 0;
+                    cf.cf_declared = -1;
+                    cf.cf_millisec = 0.0;
+                    cf.cf_nberrors = 0;
+                };
+        };
+    closedir(persidir);
+    std::sort(files.begin(), files.end(), [](const check_file_st& l, const check_file_st& r)
+    {
+        return l.cf_base < r.cf_base;
+    });
+    /// workers take the next unchecked file, the biggest ones being
+    /// usually not all at the end
+    unsigned nbthreads = std::thread::hardware_concurrency();
+    if (nbthreads == 0)
+        nbthreads = 2;
+    if (nbthreads > files.size())
+        nbthreads = files.size();
+    std::atomic<size_t> nextfile {0};
+    std::vector<std::thread> workers;
+    for (unsigned ix = 0; ix < nbthreads; ix++)
+        workers.emplace_back([&]()
+    {
+        size_t fix = 0;
+        while ((fix = nextfile.fetch_add(1)) < files.size())
+            check_one_file(files[fix]);
+    });
+    std::vector<std::string> spaceids;
+    bool crosscheck = check_manifest(refpersysdir + "/rps_manifest.json", spaceids, nberrors);
+    for (std::thread& th: workers)
+        th.join();
+    /// the manifest lists space ids, each in file persistore/sp<id>-rps.json
+    if (crosscheck)
+        {
+            std::set<std::string> presentfiles, spacefiles;
+            for (const check_file_st& cf: files)
+                presentfiles.insert(cf.cf_base);
+            for (const std::string& id: spaceids)
+                {
+                    std::string base = "sp" + id + "-rps.json";
+                    spacefiles.insert(base);
+                    if (presentfiles.find(base) == presentfiles.end())
+                        {
+                            std::clog << progname << " space " << id << " of manifest has no file "
+                                      << persistpath << "/" << base << std::endl;
+                            nberrors++;
+                        };
+                };
+            for (const check_file_st& cf: files)
+                if (cf.cf_base.size() > 11 && cf.cf_base.compare(0, 2, "sp") == 0
+                        && cf.cf_base.compare(cf.cf_base.size()-9, 9, "-rps.json") == 0
+                        && spacefiles.find(cf.cf_base) == spacefiles.end())
+                    std::clog << progname << " warning: " << cf.cf_path
+                              << " is not a space of the manifest" << std::endl;
+        };
+    /// cross file checks, done once all workers are finished
+    std::unordered_map<std::string,const check_file_st*> oidfiles;
+    std::map<std::pair<int64_t,int64_t>,std::string> namehashes;
+    size_t totsize = 0;
+    long totobjects = 0, totvalues = 0, totnames = 0;
+    double totmillisec = 0.0;
+    char linbuf[256];
+    for (check_file_st& cf: files)
+        {
+            for (const std::string& oid: cf.cf_oids)
+                {
+                    auto ins = oidfiles.emplace(oid, &cf);
+                    if (!ins.second)
+                        check_report(cf, "object " + oid + " already in " + ins.first->second->cf_base);
+                };
+            for (const check_name_st& cn: cf.cf_names)
+                {
+                    /// one character names of the same byte length hash
+                    /// alike, by design, e.g. é and ß
+                    if (cn.cn_nbchars <= 1)
+                        continue;
+                    auto ins = namehashes.emplace(std::make_pair(cn.cn_h0, cn.cn_h1), cn.cn_name);
+                    if (!ins.second && ins.first->second != cn.cn_name)
+                        check_report(cf, "symbol name " + cn.cn_name + " has the same hash as "
+                                     + ins.first->second);
+                };
+            memset (linbuf, 0, sizeof(linbuf));
+            snprintf(linbuf, sizeof(linbuf), "%-40s %10zu bytes %7ld objects %8ld values %5zu names %8.2f ms%s",
+                     cf.cf_base.c_str(), cf.cf_size, cf.cf_nbobjects, cf.cf_nbvalues,
+                     cf.cf_names.size(), cf.cf_millisec, cf.cf_nberrors?" FAILED":"");
+            std::cout << linbuf << std::endl;
+            for (const std::string& msg: cf.cf_messages)
+                std::cout << "\t" << msg << std::endl;
+            if (cf.cf_nberrors > (long)cf.cf_messages.size())
+                std::cout << "\t... and " << (cf.cf_nberrors - cf.cf_messages.size())
+                          << " more problems" << std::endl;
+            nberrors += cf.cf_nberrors;
+            totsize += cf.cf_size;
+            totobjects += cf.cf_nbobjects;
+            totvalues += cf.cf_nbvalues;
+            totnames += cf.cf_names.size();
+            totmillisec += cf.cf_millisec;
+        };
+    double wallmillisec = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - t0).count();
+    memset (linbuf, 0, sizeof(linbuf));
+    snprintf(linbuf, sizeof(linbuf), "%zu files %zu bytes %ld objects %ld values %ld names,"
+             " %.1f ms on %u threads (%.1f ms of work), %ld problems",
+             files.size(), totsize, totobjects, totvalues, totnames,
+             wallmillisec, nbthreads, totmillisec, nberrors);
+    std::cout << progname << " checked " << persistpath << ":" << std::endl
+              << linbuf << std::endl;
+    if (files.empty())
+        {
+            std::clog << progname << " found no JSON file in " << persistpath << std::endl;
+            return EXIT_FAILURE;
+        };
+    return nberrors?EXIT_FAILURE:EXIT_SUCCESS;
+} // end check_persistore
+
+/// end of file checkfltk.cc
@@ -0,0 +1,537 @@
+/**** file guifltk-refpersys/completefltk.cc ******
+ ****  SPDX-License-Identifier: MIT ******
+ *
+ * © Copyright 2023 The  Reflective Persistent System Team
+ * team@refpersys.org &   http://refpersys.org/
+ *
+ * contributors: Basile Starynkevitch <basile@starynkevitch.net>
+ *
+ **********************************************/
+
+#include "jsonrpsfltk.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+/* Every name gets an id, in order of arrival, and its characters are
+ * kept in one pool.  A name is indexed by its trigrams of ASCII
+ * lowercased bytes, padded with two zero bytes before and one after,
+ * and by its bigrams, padded with one zero byte after, so that every
+ * character starts some bigram.  Queries of five characters or more
+ * use their unpadded trigrams, shorter ones their bigrams, and a
+ * single character all the bigrams it starts; the padded trigrams at
+ * the start of the query only raise the score of prefix matches.  The
+ * posting list of a gram holds the increasing ids of the names
+ * containing it, as varint encoded deltas; new names are only
+ * appended, so updates are incremental. */
+
+struct posting_st
+{
+    std::vector<uint8_t> pl_bytes;
+    uint32_t pl_last;
+    uint32_t pl_count;
+};
+
+/// names added to the index by one lock of the writer
+constexpr unsigned completion_batch_size = 4096;
+/// posting entries read for a query of one or two characters, which
+/// would otherwise match most names and miss the frame
+constexpr size_t completion_short_budget = 16384;
+
+static std::shared_mutex compl_lock;
+static std::string compl_pool;
+static std::vector<uint32_t> compl_offsets;
+/// from std::hash of a name to its ids, to skip duplicate names
+static std::unordered_multimap<size_t, uint32_t> compl_byhash;
+static std::unordered_map<uint32_t, posting_st> compl_postings;
+
+/// work for the indexing thread
+struct completion_task_st
+{
+    std::string ct_persistpath;
+    std::vector<std::string> ct_names;
+    /// NUL terminated names, e.g. in a mapped session snapshot
+    std::shared_ptr<const char> ct_pool;
+    size_t ct_poolsize;
+    /// other work, e.g. writing the session snapshot, run after the
+    /// names queued before it are indexed
+    std::function<void(void)> ct_job;
+};
+
+static std::mutex compl_task_mtx;
+static std::condition_variable compl_task_cond;
+static std::deque<completion_task_st> compl_tasks;
+/// set by completion_stop, also polled by the long indexing tasks
+static std::atomic<bool> compl_stopping;
+static std::thread compl_thread;
+
+static inline std::string_view
+completion_name(uint32_t id)
+{
+    uint32_t start = compl_offsets[id];
+    uint32_t end = (id+1 < compl_offsets.size())?compl_offsets[id+1]:compl_pool.size();
+    return std::string_view(compl_pool).substr(start, end-start);
+} // end completion_name
+
+static inline char
+fold_char(char c)
+{
+    return (c >= 'A' && c <= 'Z')?(c - 'A' + 'a'):c;
+} // end fold_char
+
+/// trigrams are below 1<<24, so bigrams are tagged above
+static inline uint32_t
+trigram_key(uint32_t a, uint32_t b, uint32_t c)
+{
+    return (a << 16) | (b << 8) | c;
+} // end trigram_key
+
+static inline uint32_t
+bigram_key(uint32_t a, uint32_t b)
+{
+    return (1u << 24) | (a << 8) | b;
+} // end bigram_key
+
+static void
+sort_grams(std::vector<uint32_t>& grams)
+{
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+} // end sort_grams
+
+/// the grams indexing a name, see the comment above
+static void
+name_grams(std::string_view name, std::vector<uint32_t>& grams)
+{
+    grams.clear();
+    size_t len = name.size();
+    auto byte_at = [&](size_t i) -> uint32_t
+    {
+        /// index 0 and 1 are the padding before the name
+        if (i < 2 || i-2 >= len)
+            return 0;
+        return (uint8_t)fold_char(name[i-2]);
+    };
+    for (size_t i = 0; i+2 < len+3; i++)
+        grams.push_back(trigram_key(byte_at(i), byte_at(i+1), byte_at(i+2)));
+    for (size_t i = 2; i < len+2; i++)
+        grams.push_back(bigram_key(byte_at(i), byte_at(i+1)));
+    sort_grams(grams);
+} // end name_grams
+
+/// the grams of an already folded query, which should all be in a
+/// matching name, and its padded start trigrams, which only help
+static void
+query_grams(std::string_view q, std::vector<uint32_t>& grams, std::vector<uint32_t>& startgrams)
+{
+    grams.clear();
+    startgrams.clear();
+    size_t len = q.size();
+    auto byte_at = [&](size_t i) -> uint32_t
+    {
+        return (uint8_t)q[i];
+    };
+    if (len >= 5)
+        for (size_t i = 0; i+2 < len; i++)
+            grams.push_back(trigram_key(byte_at(i), byte_at(i+1), byte_at(i+2)));
+    else if (len >= 2)
+        for (size_t i = 0; i+1 < len; i++)
+            grams.push_back(bigram_key(byte_at(i), byte_at(i+1)));
+    else if (len == 1)
+        for (uint32_t b = 0; b < 256; b++)
+            grams.push_back(bigram_key(byte_at(0), b));
+    sort_grams(grams);
+    startgrams.push_back(trigram_key(0, 0, byte_at(0)));
+    if (len >= 2)
+        startgrams.push_back(trigram_key(0, byte_at(0), byte_at(1)));
+} // end query_grams
+
+static void
+posting_append(posting_st& pl, uint32_t id)
+{
+    uint32_t delta = pl.pl_count?(id - pl.pl_last):id;
+    while (delta >= 0x80)
+        {
+            pl.pl_bytes.push_back((uint8_t)((delta & 0x7f) | 0x80));
+            delta >>= 7;
+        };
+    pl.pl_bytes.push_back((uint8_t)delta);
+    pl.pl_last = id;
+    pl.pl_count++;
+} // end posting_append
+
+/// with the writer lock held
+static void
+index_name(std::string_view name, std::vector<uint32_t>& tri)
+{
+    if (name.empty() || compl_pool.size() + name.size() >= UINT32_MAX)
+        return;
+    size_t h = std::hash<std::string_view> {}(name);
+    auto range = compl_byhash.equal_range(h);
+    for (auto it = range.first; it != range.second; it++)
+        if (completion_name(it->second) == name)
+            return;
+    uint32_t id = compl_offsets.size();
+    compl_offsets.push_back(compl_pool.size());
+    compl_pool.append(name);
+    compl_byhash.insert({h, id});
+    name_grams(name, tri);
+    for (uint32_t t: tri)
+        posting_append(compl_postings[t], id);
+} // end index_name
+
+static void
+index_names(const std::vector<std::string>& names)
+{
+    std::vector<uint32_t> tri;
+    for (size_t start = 0; start < names.size() && !compl_stopping; start += completion_batch_size)
+        {
+            std::unique_lock<std::shared_mutex> lk(compl_lock);
+            size_t end = std::min(names.size(), start + completion_batch_size);
+            for (size_t ix = start; ix < end; ix++)
+                index_name(names[ix], tri);
+        };
+} // end index_names
+
+static void
+index_name_pool(const char*pool, size_t size)
+{
+    std::vector<uint32_t> tri;
+    const char*end = pool + size;
+    const char*pc = pool;
+    while (pc < end)
+        {
+            std::unique_lock<std::shared_mutex> lk(compl_lock);
+            for (unsigned nb = 0; nb < completion_batch_size && pc < end; nb++)
+                {
+                    const char*eos = (const char*)memchr(pc, 0, end - pc);
+                    if (!eos)
+                        eos = end;
+                    index_name(std::string_view(pc, eos - pc), tri);
+                    pc = eos + 1;
+                };
+        };
+} // end index_name_pool
+
+static bool
+collect_symbol_names(json_reader& rd, std::vector<std::string>& names, int depth)
+{
+    if (depth > 256)
+        return rd.fail("too deeply nested");
+    std::string_view key;
+    switch (rd.peek())
+        {
+        case '{':
+            rd.begin_object();
+            while (rd.next_member(key))
+                {
+                    if (key == "symb_name" && rd.peek() == '"')
+                        {
+                            names.emplace_back();
+                            if (!rd.read_string(names.back()))
+                                return false;
+                        }
+                    else if (!collect_symbol_names(rd, names, depth+1))
+                        return false;
+                };
+            return rd.ok();
+        case '[':
+            rd.begin_array();
+            while (rd.next_element())
+                if (!collect_symbol_names(rd, names, depth+1))
+                    return false;
+            return rd.ok();
+        default:
+            return rd.skip_value();
+        };
+} // end collect_symbol_names
+
+static void
+index_persistore(const std::string& persistpath)
+{
+    DIR* persidir = opendir(persistpath.c_str());
+    if (!persidir)
+        {
+            std::clog << progname << " completion cannot open " << persistpath
+                      << " :" << strerror(errno) << std::endl;
+            return;
+        };
+    std::vector<std::string> jsonpaths;
+    struct dirent* ent = nullptr;
+    while ((ent = readdir(persidir)) != nullptr)
+        {
+            int nlen = strlen(ent->d_name);
+            if (ent->d_type == DT_REG && isalnum(ent->d_name[0])
+                    && nlen > 5 && !strcmp(ent->d_name+nlen-5, ".json"))
+                jsonpaths.push_back(persistpath + "/" + ent->d_name);
+        };
+    closedir(persidir);
+    std::sort(jsonpaths.begin(), jsonpaths.end());
+    for (const std::string& path: jsonpaths)
+        {
+            if (compl_stopping)
+                break;
+            FILE* fil = fopen(path.c_str(), "r");
+            if (!fil)
+                continue;
+            std::string content;
+            char buf[4*frps_buffer_size];
+            size_t nb = 0;
+            while ((nb = fread(buf, 1, sizeof(buf), fil)) > 0)
+                content.append(buf, nb);
+            fclose(fil);
+            json_reader rd(content);
+            std::vector<std::string> names;
+            while (!rd.at_end() && collect_symbol_names(rd, names, 0))
+                continue;
+            if (!rd.ok())
+                std::clog << progname << " completion stopped reading " << path
+                          << ": " << rd.error() << " at " << rd.position() << std::endl;
+            index_names(names);
+        };
+} // end index_persistore
+
+static void
+completion_thread_body(void)
+{
+    for (;;)
+        {
+            completion_task_st task;
+            {
+                std::unique_lock<std::mutex> lk(compl_task_mtx);
+                compl_task_cond.wait(lk, [] { return compl_stopping || !compl_tasks.empty(); });
+                if (compl_tasks.empty())
+                    return;
+                task = std::move(compl_tasks.front());
+                compl_tasks.pop_front();
+            }
+            /// when stopping, names from a persistore or from RefPerSys
+            /// are dropped, since they are found again at next start,
+            /// but the names of the previous snapshot are still indexed
+            /// for the snapshot saved at exit, which replaces it
+            if (task.ct_pool)
+                index_name_pool(task.ct_pool.get(), task.ct_poolsize);
+            if (!task.ct_persistpath.empty() && !compl_stopping)
+                index_persistore(task.ct_persistpath);
+            index_names(task.ct_names);
+            if (task.ct_job)
+                task.ct_job();
+        };
+} // end completion_thread_body
+
+static void
+completion_queue(completion_task_st&& task)
+{
+    {
+        std::lock_guard<std::mutex> lk(compl_task_mtx);
+        compl_tasks.push_back(std::move(task));
+    }
+    compl_task_cond.notify_one();
+} // end completion_queue
+
+void
+completion_start(void)
+{
+    if (compl_thread.joinable())
+        return;
+    compl_stopping = false;
+    compl_thread = std::thread(completion_thread_body);
+} // end completion_start
+
+void
+completion_stop(void)
+{
+    if (!compl_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lk(compl_task_mtx);
+        compl_stopping = true;
+    }
+    compl_task_cond.notify_one();
+    compl_thread.join();
+} // end completion_stop
+
+void
+completion_add_names(std::vector<std::string> names)
+{
+    if (names.empty())
+        return;
+    completion_queue(completion_task_st {std::string(), std::move(names), nullptr, 0, nullptr});
+} // end completion_add_names
+
+void
+completion_add_name_pool(std::shared_ptr<const char> pool, size_t size)
+{
+    if (!pool || size == 0)
+        return;
+    completion_queue(completion_task_st {std::string(), {}, std::move(pool), size, nullptr});
+} // end completion_add_name_pool
+
+void
+completion_run_job(std::function<void(void)> job)
+{
+    if (!job)
+        return;
+    if (!compl_thread.joinable())
+        {
+            job();
+            return;
+        };
+    completion_queue(completion_task_st {std::string(), {}, nullptr, 0, std::move(job)});
+} // end completion_run_job
+
+void
+completion_load_persistore(const std::string& persistpath)
+{
+    completion_queue(completion_task_st {persistpath, {}, nullptr, 0, nullptr});
+} // end completion_load_persistore
+
+void
+completion_for_each_name(const std::function<void(std::string_view name)>& fun)
+{
+    std::shared_lock<std::shared_mutex> lk(compl_lock);
+    for (uint32_t id = 0; id < compl_offsets.size(); id++)
+        fun(completion_name(id));
+} // end completion_for_each_name
+
+size_t
+completion_name_count(void)
+{
+    std::shared_lock<std::shared_mutex> lk(compl_lock);
+    return compl_offsets.size();
+} // end completion_name_count
+
+/// case insensitive position of q in name, or npos
+static size_t
+folded_find(std::string_view name, std::string_view q)
+{
+    auto it = std::search(name.begin(), name.end(), q.begin(), q.end(),
+                          [](char a, char b)
+    {
+        return fold_char(a) == b;
+    });
+    return (it == name.end())?std::string_view::npos:(size_t)(it - name.begin());
+} // end folded_find
+
+std::vector<completion_match_st>
+complete_name(const std::string& query, unsigned maxcount)
+{
+    /// kept between calls, so a query allocates almost nothing
+    static std::vector<uint8_t> hits;
+    static std::vector<uint8_t> starthits;
+    static std::vector<uint32_t> touched;
+    static std::vector<uint32_t> qgrams;
+    static std::vector<uint32_t> qstart;
+    std::vector<completion_match_st> res;
+    std::string q;
+    for (char c: query)
+        q.push_back(fold_char(c));
+    if (q.empty() || maxcount == 0)
+        return res;
+    query_grams(q, qgrams, qstart);
+    std::shared_lock<std::shared_mutex> lk(compl_lock);
+    size_t nbnames = compl_offsets.size();
+    if (hits.size() < nbnames)
+        {
+            hits.resize(nbnames, 0);
+            starthits.resize(nbnames, 0);
+        };
+    size_t budget = (q.size() <= 2)?completion_short_budget:SIZE_MAX;
+    auto for_each_posting = [&](uint32_t gram, auto fun)
+    {
+        auto pit = compl_postings.find(gram);
+        if (pit == compl_postings.end())
+            return;
+        const posting_st& pl = pit->second;
+        const uint8_t* p = pl.pl_bytes.data();
+        uint32_t id = 0;
+        for (uint32_t k = 0; k < pl.pl_count && budget > 0; k++, budget--)
+            {
+                uint32_t delta = 0;
+                int shift = 0;
+                while (*p & 0x80)
+                    {
+                        delta |= (uint32_t)(*p++ & 0x7f) << shift;
+                        shift += 7;
+                    };
+                delta |= (uint32_t)(*p++) << shift;
+                id = k?(id + delta):delta;
+                fun(id);
+            };
+    };
+    /// a short query looks first at the names starting with it, whose
+    /// start trigrams all match, then at others while the budget lasts
+    if (q.size() <= 2)
+        for_each_posting(qstart.back(), [&](uint32_t id)
+    {
+        touched.push_back(id);
+        hits[id] = 255;
+        starthits[id] = qstart.size();
+    });
+    for (uint32_t g: qgrams)
+        for_each_posting(g, [&](uint32_t id)
+    {
+        if (hits[id] == 0)
+            touched.push_back(id);
+        if (hits[id] < 255)
+            hits[id]++;
+    });
+    /// the start trigrams only score names already found
+    if (q.size() > 2)
+        for (uint32_t g: qstart)
+            for_each_posting(g, [&](uint32_t id)
+    {
+        if (hits[id] > 0)
+            starthits[id]++;
+    });
+    /// a single character is one of many bigrams, any of them matches
+    unsigned nbgrams = (q.size() == 1)?1:qgrams.size();
+    /// a fuzzy match shares at least half of the query trigrams, or
+    /// all but one of the three bigrams of a short query
+    unsigned minhits = nbgrams;
+    if (q.size() >= 5)
+        minhits = (nbgrams+1)/2;
+    else if (nbgrams > 2)
+        minhits = nbgrams-1;
+    std::vector<std::pair<int,uint32_t>> cands;
+    for (uint32_t id: touched)
+        {
+            unsigned h = std::min<unsigned>(hits[id], nbgrams);
+            unsigned sh = starthits[id];
+            hits[id] = 0;
+            starthits[id] = 0;
+            if (h < minhits)
+                continue;
+            std::string_view name = completion_name(id);
+            int score = (int)(1000*h/nbgrams) + 100*sh - (int)name.size();
+            size_t pos = folded_find(name, q);
+            if (pos == 0)
+                score += 500;
+            else if (pos != std::string_view::npos)
+                score += 250;
+            cands.push_back({score, id});
+        };
+    touched.clear();
+    auto better = [](const std::pair<int,uint32_t>& a, const std::pair<int,uint32_t>& b)
+    {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    if (cands.size() > maxcount)
+        {
+            std::nth_element(cands.begin(), cands.begin()+maxcount, cands.end(), better);
+            cands.resize(maxcount);
+        };
+    std::sort(cands.begin(), cands.end(), better);
+    res.reserve(cands.size());
+    for (auto& c: cands)
+        res.push_back(completion_match_st {std::string(completion_name(c.second)), c.first});
+    return res;
+} // end complete_name
+
+/// end of file completefltk.cc
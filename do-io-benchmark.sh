@@ -0,0 +1,31 @@
+#!/bin/bash
+#% SPDX-License-Identifier: MIT
+# guifltk-refpersys file do-io-benchmark.sh - see refpersys.org
+###
+# it compares the poll and io_uring backends of the FIFOs to RefPerSys,
+# running guifltkrps --io-bench under strace -c, which counts the
+# system calls of the GUI process (not of its forked fake RefPerSys).
+#
+# usage: ./do-io-benchmark.sh [message-count [guifltkrps-program]]
+#%
+#%      © Copyright 2023 The Reflective Persistent System Team
+#%      <http://refpersys.org>
+
+count=${1:-100000}
+prog=${2:-./guifltkrps}
+tmpstrace=$(mktemp /tmp/guifltkrps-strace-XXXXXX)
+trap "/bin/rm -f $tmpstrace" EXIT
+
+for backend in "" "--io-uring"; do
+    echo "#### $prog --io-bench=$count $backend"
+    if command -v strace > /dev/null ; then
+        strace -c -o $tmpstrace $prog --io-bench=$count $backend || exit 1
+        total=$(awk '$NF == "total" { print $4 }' $tmpstrace)
+        echo "## strace -c: $total syscalls for $count messages," \
+             $(awk -v t="$total" -v n="$count" 'BEGIN { printf "%.2f", t/n }') "syscalls/message"
+        head -n 12 $tmpstrace
+    else
+        echo "## strace not found, running without it"
+        $prog --io-bench=$count $backend || exit 1
+    fi
+done
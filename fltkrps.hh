@@ -22,6 +22,7 @@
 #include <map>
 #include <vector>
 #include <set>
+#include <memory>
 #include <iostream>
 
 /// POSIX headers
@@ -34,6 +35,8 @@
 #include <sys/stat.h>
 #include <elf.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <fcntl.h>
 
@@ -42,6 +45,9 @@
 #include <unitypes.h>
 #include <unistr.h>
 
+/// from jsoncpp
+#include <json/json.h>
+
 /// FLTK headers
 #include <FL/Fl.H>
 #include <Fl/platform.H>
@@ -52,6 +58,7 @@
 /// standard C++
 #include <functional>
 #include <string>
+#include <string_view>
 
 extern "C" const char*progname;
 extern "C" char myhostname[];
@@ -66,11 +73,180 @@ extern "C" int preferred_height, preferred_width;
 extern "C" float screen_scale;
 
 
-/// handler for FIFOs to RefPerSys - in file
+/// handler for FIFOs to RefPerSys - in file jsonrpsfltk.cc; their
+/// data is the connection_st owning the file descriptor
 extern "C" void out_fd_handler(int fd, void*data);
 extern "C" void cmd_fd_handler(int fd, void*data);
 
 constexpr unsigned frps_buffer_size = 2048;
+/// bytes asked by each read of a command FIFO, the same for the poll
+/// and io_uring backends so that --io-bench compares them fairly
+constexpr unsigned frps_read_size = 16*frps_buffer_size;
+
+/* each JSON message on the FIFOs ends with a formfeed, so it may
+   contain newlines */
+constexpr char frps_message_terminator = '\f';
+
+class json_reader;
+class message_arena;
+struct connection_st;
+
+/// handles the result of a reply from RefPerSys, see jsonrpsfltk.hh
+typedef std::function<void(connection_st*conn, json_reader& result)> json_reply_handler_t;
+/// handles the error reply of RefPerSys to some request
+typedef std::function<void(connection_st*conn, const std::string& errmsg)> json_failure_handler_t;
+
+/// a request sent to RefPerSys and waiting for its reply
+struct pending_request_st
+{
+    std::string preq_method;
+    json_reply_handler_t preq_handler;
+    json_failure_handler_t preq_failure;
+};
+
+/// how far a connection to RefPerSys is
+enum connection_state_en
+{
+    CONNSTATE_WAITING=0,	// RefPerSys does not yet read its output FIFO
+    CONNSTATE_CONNECTED,
+    CONNSTATE_DISCONNECTED,	// after an end of file or an error
+};
+
+/// delay in seconds between attempts to open an output FIFO
+constexpr double frps_reopen_delay = 0.25;
+/// a peer sending a longer message without terminator is disconnected
+constexpr size_t frps_max_message_size = 32 << 20;
+
+/// an object cached from RefPerSys, with the stamp of its last use
+struct cached_object_st
+{
+    std::string co_json;
+    long co_stamp;
+};
+
+/* A connection to one RefPerSys process, thru its two FIFOs
+   <prefix>.cmd (written by RefPerSys, read by us) and <prefix>.out
+   (written by us, read by RefPerSys).  A single GUI process can
+   handle several connections, all multiplexed in the FLTK event
+   loop, each with its own window. */
+struct connection_st
+{
+    int conn_rank;
+    std::string conn_fifo_prefix;
+    connection_state_en conn_state;
+    int conn_cmdfd;
+    int conn_outfd;
+    /// bytes read from the command FIFO, not yet a complete message
+    std::string conn_inbuf;
+    /// length of the start of conn_inbuf known to have no terminator
+    size_t conn_inscanned;
+    /// bytes to be written to the output FIFO
+    std::string conn_outbuf;
+    /// pending requests sent to RefPerSys, by JSONRPC id
+    std::map<long, pending_request_st> conn_requests;
+    long conn_last_reqid;
+    /// cache of JSON values known from this RefPerSys, by object id;
+    /// the session snapshot keeps the most recently used ones
+    std::map<std::string, cached_object_st> conn_objcache;
+    /// where each incoming message is decoded, released after it
+    message_arena* conn_arena;
+    /// oids of cached objects restored from the session snapshot, to
+    /// be asked again to RefPerSys
+    std::set<std::string> conn_stale_oids;
+    /// why the connection was lost, shown with its state
+    std::string conn_disconnect_reason;
+    Fl_Window* conn_window;
+    /// the fitted_box showing the state of the connection in its window
+    Fl_Box* conn_statusbox;
+    /// when true, the FIFOs are handled by io_uring, not by Fl::add_fd
+    bool conn_uring;
+    /// true while an io_uring write of conn_uring_wbuf is in flight
+    bool conn_uring_writing;
+    std::string conn_uring_wbuf;
+    connection_st(int rank, const std::string& prefix);
+    ~connection_st();
+    connection_st(const connection_st&) = delete;
+    connection_st& operator = (const connection_st&) = delete;
+    /// open both FIFOs and register them in the FLTK event loop; the
+    /// output FIFO is opened later if RefPerSys does not read it yet
+    bool open_fifos(void);
+    /// give 1 once the output FIFO is opened, 0 if RefPerSys does not
+    /// read it yet, and -1 on failure
+    int open_output_fifo(void);
+    void close_fifos(void);
+    /// close the FIFOs for good, after an end of file or an error
+    void disconnect(const char*why);
+    /// show conn_state in the status box of the window
+    void show_state(void);
+    /// append a JSONRPC request to the output buffer, returning its id
+    long send_request(const std::string& method, const std::string& jsonparams,
+                      json_reply_handler_t handler = nullptr,
+                      json_failure_handler_t failure = nullptr);
+    /// append a JSONRPC reply to some request from RefPerSys, whose
+    /// id is echoed as the JSON text it had, a number or a string
+    void send_reply(std::string_view jsonid, const std::string& jsonresult);
+    void send_error(std::string_view jsonid, int code, const std::string& message);
+    /// append a complete message to the output buffer
+    void send_message(const std::string& msg);
+    /// read what is available on the command FIFO
+    void handle_input(int fd);
+    /// split the bytes read from the command FIFO into messages
+    void consume_input(const char*buf, size_t nb);
+    /// write some of the output buffer on the output FIFO
+    void handle_output(int fd);
+    /// process one complete JSON message from RefPerSys
+    void process_message(std::string_view msg);
+    /// put or refresh an object in conn_objcache, as just used
+    void cache_object(const std::string& oid, std::string json);
+    /// the cached JSON of an object, marked as just used, or null
+    const std::string* cached_object(const std::string& oid);
+};
+
+extern "C" std::vector<connection_st*> vector_connections;
+
+/* Plugins can handle requests from RefPerSys whose method has no
+   typed handler (see jsonrpsfltk.hh).  The handler gets the params as
+   a Json::Value and should fill the result, returning true on
+   success. */
+typedef bool generic_json_handler_t(connection_st*conn,
+                                    const Json::Value& params,
+                                    Json::Value& result);
+extern "C" void register_generic_json_handler(const char*method,
+        generic_json_handler_t*handler);
+
+/// I/O statistics for all connections, shown by --io-stats
+struct io_stats_st
+{
+    long ios_nb_syscalls;	// read, write, io_uring_enter and event loop wakeups
+    long ios_nb_messages;	// complete JSON messages received
+    long ios_nb_inbytes;
+    long ios_nb_outbytes;
+    long ios_nb_arena_allocs;	// allocations in message arenas
+    long ios_nb_arena_bytes;
+    long ios_max_arena_allocs;	// most allocations for one message
+};
+extern "C" io_stats_st frps_io_stats;
+extern "C" void show_io_stats(void);
+
+/* The --io-bench=<count> mode, in file benchfltk.cc, serves <count>
+   requests of a forked fake RefPerSys thru a FIFO pair, and measures
+   the syscalls and CPU time of the event loop alone.  Use it with and
+   without --io-uring, or thru do-io-benchmark.sh, to compare both
+   backends.  It gives the exit status of the program. */
+extern "C" long io_bench_count;
+extern "C" int io_benchmark(long count);
+
+/* Optional io_uring backend for the FIFOs, in file iouringfltk.cc,
+   compiled with -DFLTKRPS_IO_URING (make IO_URING=1).  Reads use
+   registered buffers, writes are batched into one io_uring_enter per
+   event loop turn, and completions are signalled by an eventfd known
+   to Fl::add_fd.  When io_uring is unavailable, iouring_start returns
+   false and the connections use the poll path of Fl::add_fd. */
+extern "C" bool use_io_uring;
+extern "C" bool iouring_start(void);
+extern "C" bool iouring_attach(connection_st*conn);
+extern "C" void iouring_detach(connection_st*conn);
+extern "C" void iouring_flush(connection_st*conn);
 
 /* Return true if plugin was loaded successfully; A plugin foo/bar
    dlopen foo/bar.so and calls its function bool fltkrps_bar_start()
@@ -82,6 +258,111 @@ extern "C" bool load_plugin(const char*plugname);
 /* Return true if the given string is unique valid RefPerSys path */
 extern "C" bool set_refpersys_path(const char*path);
 
+/// the RefPerSys directory, once validated by set_refpersys_path
+extern "C" std::string refpersys_path;
+
+
+/* Client side completion of RefPerSys object and symbol names, in
+   file completefltk.cc.  Names are indexed on a background thread by
+   their trigrams, with delta-compressed posting lists, so an input
+   widget can complete each keystroke locally without a FIFO round
+   trip. */
+extern "C" void completion_start(void);
+/// join the completion thread, after the queued jobs but dropping
+/// the queued persistores and names
+extern "C" void completion_stop(void);
+/// queue names for indexing, e.g. names reported by RefPerSys
+extern void completion_add_names(std::vector<std::string> names);
+/// queue NUL terminated names, the pool being kept alive till they are indexed
+extern void completion_add_name_pool(std::shared_ptr<const char> pool, size_t size);
+/// queue the symbol names of all the JSON files of some persistore directory
+extern void completion_load_persistore(const std::string& persistpath);
+/// run job on the completion thread, after the names already queued;
+/// completion_stop waits for it
+extern void completion_run_job(std::function<void(void)> job);
+extern size_t completion_name_count(void);
+extern void completion_for_each_name(const std::function<void(std::string_view name)>& fun);
+
+struct completion_match_st
+{
+    std::string cm_name;
+    int cm_score;
+};
+
+/// the best ranked fuzzy matches of query, from the GUI thread only;
+/// no widget of this GUI calls it yet, it is an API for plugins and
+/// for the future input widgets of connection windows
+extern std::vector<completion_match_st> complete_name(const std::string& query,
+        unsigned maxcount = 16);
+
+
+/* The measured layout of some UTF-8 label text in some font, size
+   and screen_scale, kept in a bounded LRU cache by textfltk.cc, since
+   fl_measure and fl_width are costly on every redraw.  The cache is
+   cleared when screen_scale changes. */
+struct text_layout_st
+{
+    /// the width of the whole text, as fl_draw draws it
+    int tl_width;
+    int tl_height;
+    int tl_ellipsis_width;
+    int tl_len;
+    /// the last cut computed by text_fit_length, since a label is
+    /// usually drawn again at the same width
+    mutable int tl_fit_maxwidth;
+    mutable int tl_fit_len;
+};
+
+/// use the current fl_font and fl_size; len<0 means strlen
+extern std::shared_ptr<const text_layout_st> text_layout(const char*str, int len= -1);
+
+/* Give the byte length of the longest prefix of the text str, laid
+   out as tl in the current font, fitting in maxwidth pixels with an
+   ellipsis after it, or the whole length when all the text fits. */
+extern int text_fit_length(const char*str, const text_layout_st&tl, int maxwidth);
+
+/// draw the text at x,y, truncated with an ellipsis to fit in maxwidth
+extern void draw_fitted_text(const char*str, int x, int y, int maxwidth);
+
+/* A box whose label is drawn on one line, cut with an ellipsis when
+   it is wider than the box, thru the text layout cache. */
+class fitted_box : public Fl_Box
+{
+public:
+    fitted_box(int x, int y, int w, int h, const char*label = nullptr)
+        : Fl_Box(x, y, w, h, label) {};
+protected:
+    void draw(void) override;
+};
+
+/// limit in bytes of the text layout cache
+constexpr size_t frps_text_cache_budget = 4 << 20;
+
+
+/* Session snapshot, in file sessionfltk.cc, written at exit and
+   every frps_session_period seconds, and mmapped at startup.  It
+   keeps the geometry of windows, the FIFO prefixes of connections,
+   the names known for completion and the object caches, so the first
+   frame shows the last state while cached objects are revalidated in
+   the background against RefPerSys. */
+extern "C" std::string session_path;
+extern "C" bool session_restore(void);
+/// queue a snapshot, written by the completion thread
+extern "C" bool session_save(void);
+extern "C" void session_start_autosave(void);
+
+constexpr double frps_session_period = 120.0;
+/// limit in bytes of the cached objects kept in the snapshot
+constexpr size_t frps_session_cache_budget = 16 << 20;
+
+
+/* Offline check of a RefPerSys directory, in file checkfltk.cc, for
+   the --check-persistore option: every persistore JSON file is parsed
+   by a pool of threads, cross-checked with rps_manifest.json, and
+   names are checked for UTF-8 and hashed.  It opens no display, and
+   gives the exit status of the program. */
+extern "C" int check_persistore(const std::string& refpersysdir);
+
 
 /** An important function from RefPerSys code file scalar_rps.cc in
  *  mid-september 2023.
@@ -0,0 +1,324 @@
+/**** file guifltk-refpersys/iouringfltk.cc ******
+ ****  SPDX-License-Identifier: MIT ******
+ *
+ * © Copyright 2023 The  Reflective Persistent System Team
+ * team@refpersys.org &   http://refpersys.org/
+ *
+ * contributors: Basile Starynkevitch <basile@starynkevitch.net>
+ *
+ **********************************************/
+
+#include "fltkrps.hh"
+
+/// set by the --io-uring program option, cleared if io_uring is unavailable
+bool use_io_uring;
+
+#ifdef FLTKRPS_IO_URING
+
+#include <liburing.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/// each connection using io_uring gets one registered read buffer,
+/// indexed by its rank; other connections use the poll path.
+constexpr unsigned frps_uring_max_connections = 16;
+constexpr unsigned frps_uring_buffer_size = frps_read_size;
+constexpr unsigned frps_uring_entries = 4*frps_uring_max_connections;
+
+static struct io_uring frps_ring;
+static int frps_ring_eventfd = -1;
+static bool frps_ring_submit_pending;
+static char frps_ring_buffers[frps_uring_max_connections][frps_uring_buffer_size];
+/// true once some bytes came from the command FIFO of that connection
+static bool frps_ring_gotinput[frps_uring_max_connections];
+
+/// user data of submissions whose completion is ignored
+constexpr uintptr_t frps_uring_ignored = UINTPTR_MAX;
+
+enum uring_op_en
+{
+    URING_READ=0,
+    URING_WRITE=1,
+    URING_POLL=2,
+};
+
+static inline void*
+uring_userdata(const connection_st*conn, uring_op_en op)
+{
+    return (void*)(((uintptr_t)conn->conn_rank << 2) | (uintptr_t)op);
+} // end uring_userdata
+
+static void
+iouring_submit_cb(void*)
+{
+    frps_ring_submit_pending = false;
+    frps_io_stats.ios_nb_syscalls++;
+    int r = io_uring_submit(&frps_ring);
+    if (r < 0)
+        std::clog << progname << " failed to submit to io_uring:" << strerror(-r) << std::endl;
+} // end iouring_submit_cb
+
+/// all the submissions of an event loop turn go in one io_uring_enter
+static void
+iouring_schedule_submit(void)
+{
+    if (frps_ring_submit_pending)
+        return;
+    frps_ring_submit_pending = true;
+    Fl::add_timeout(0.0, iouring_submit_cb);
+} // end iouring_schedule_submit
+
+static struct io_uring_sqe*
+iouring_get_sqe(void)
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&frps_ring);
+    if (!sqe)
+        {
+            /// the submission queue is full, so flush it now
+            frps_io_stats.ios_nb_syscalls++;
+            io_uring_submit(&frps_ring);
+            sqe = io_uring_get_sqe(&frps_ring);
+        };
+    if (!sqe)
+        std::clog << progname << " io_uring submission queue is full" << std::endl;
+    return sqe;
+} // end iouring_get_sqe
+
+static void
+iouring_arm(connection_st*conn, uring_op_en op)
+{
+    struct io_uring_sqe* sqe = iouring_get_sqe();
+    if (!sqe)
+        return;
+    unsigned rk = conn->conn_rank;
+    if (op == URING_READ)
+        io_uring_prep_read_fixed(sqe, conn->conn_cmdfd,
+                                 frps_ring_buffers[rk], frps_uring_buffer_size,
+                                 0, rk);
+    else if (op == URING_POLL)
+        io_uring_prep_poll_add(sqe, conn->conn_cmdfd, POLLIN);
+    else
+        io_uring_prep_write(sqe, conn->conn_outfd,
+                            conn->conn_uring_wbuf.data(),
+                            conn->conn_uring_wbuf.size(), 0);
+    io_uring_sqe_set_data(sqe, uring_userdata(conn, op));
+    iouring_schedule_submit();
+} // end iouring_arm
+
+static void
+iouring_complete(uintptr_t udata, int res)
+{
+    if (udata == frps_uring_ignored)
+        return;
+    unsigned rk = udata >> 2;
+    uring_op_en op = (uring_op_en)(udata & 3);
+    if (rk >= vector_connections.size())
+        return;
+    connection_st*conn = vector_connections[rk];
+    if (!conn || !conn->conn_uring || res == -ECANCELED)
+        return;
+    switch (op)
+        {
+        case URING_READ:
+            if (res == -EINTR || res == -EAGAIN)
+                iouring_arm(conn, URING_READ);
+            else if (res < 0)
+                {
+                    std::clog << progname << " connection#" << rk
+                              << " failed to read command FIFO " << conn->conn_fifo_prefix << ".cmd :"
+                              << strerror(-res) << std::endl;
+                    conn->disconnect("read error");
+                }
+            else if (res == 0)
+                {
+                    /// a FIFO never written yet reads as end of file, so wait
+                    /// for RefPerSys to open it; otherwise this is a real end of file
+                    if (!frps_ring_gotinput[rk])
+                        iouring_arm(conn, URING_POLL);
+                    else
+                        conn->disconnect("end of file");
+                }
+            else
+                {
+                    frps_ring_gotinput[rk] = true;
+                    conn->consume_input(frps_ring_buffers[rk], res);
+                    if (conn->conn_uring)
+                        iouring_arm(conn, URING_READ);
+                };
+            break;
+        case URING_POLL:
+            if (res < 0)
+                {
+                    std::clog << progname << " connection#" << rk
+                              << " failed to poll command FIFO " << conn->conn_fifo_prefix << ".cmd :"
+                              << strerror(-res) << std::endl;
+                    conn->disconnect("poll error");
+                }
+            /// a writer came and went without writing, like the
+            /// end of file seen by handle_input on the poll path
+            else if ((res & POLLHUP) && !(res & POLLIN))
+                conn->disconnect("end of file");
+            else
+                iouring_arm(conn, URING_READ);
+            break;
+        case URING_WRITE:
+            conn->conn_uring_writing = false;
+            if (res < 0 && res != -EINTR && res != -EAGAIN)
+                {
+                    std::clog << progname << " connection#" << rk
+                              << " failed to write output FIFO " << conn->conn_fifo_prefix << ".out :"
+                              << strerror(-res) << std::endl;
+                    conn->disconnect("write error");
+                    return;
+                };
+            if (res > 0)
+                {
+                    frps_io_stats.ios_nb_outbytes += res;
+                    conn->conn_uring_wbuf.erase(0, res);
+                };
+            iouring_flush(conn);
+            break;
+        };
+} // end iouring_complete
+
+/// called by FLTK when the eventfd registered in the ring is readable
+static void
+iouring_event_handler(int fd, void*)
+{
+    static std::vector<std::pair<uintptr_t,int>> donevec;
+    uint64_t cnt = 0;
+    /// one wakeup of the event loop, and one read of the eventfd
+    frps_io_stats.ios_nb_syscalls += 2;
+    if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        std::clog << progname << " failed to read io_uring eventfd:" << strerror(errno) << std::endl;
+    /// collect completions first, since handling them submits new requests
+    donevec.clear();
+    struct io_uring_cqe* cqe = nullptr;
+    unsigned head = 0;
+    unsigned nbcqe = 0;
+    io_uring_for_each_cqe(&frps_ring, head, cqe)
+    {
+        donevec.push_back({(uintptr_t)io_uring_cqe_get_data(cqe), cqe->res});
+        nbcqe++;
+    }
+    io_uring_cq_advance(&frps_ring, nbcqe);
+    for (auto& d: donevec)
+        iouring_complete(d.first, d.second);
+} // end iouring_event_handler
+
+bool
+iouring_start(void)
+{
+    int r = io_uring_queue_init(frps_uring_entries, &frps_ring, 0);
+    if (r < 0)
+        {
+            std::clog << progname << " cannot use io_uring:" << strerror(-r) << std::endl;
+            return false;
+        };
+    frps_ring_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (frps_ring_eventfd < 0
+            || io_uring_register_eventfd(&frps_ring, frps_ring_eventfd) < 0)
+        {
+            std::clog << progname << " cannot register eventfd for io_uring:" << strerror(errno) << std::endl;
+            if (frps_ring_eventfd >= 0)
+                close(frps_ring_eventfd), frps_ring_eventfd = -1;
+            io_uring_queue_exit(&frps_ring);
+            return false;
+        };
+    struct iovec iov[frps_uring_max_connections];
+    for (unsigned ix=0; ix<frps_uring_max_connections; ix++)
+        {
+            iov[ix].iov_base = frps_ring_buffers[ix];
+            iov[ix].iov_len = frps_uring_buffer_size;
+        };
+    r = io_uring_register_buffers(&frps_ring, iov, frps_uring_max_connections);
+    if (r < 0)
+        {
+            std::clog << progname << " cannot register io_uring buffers:" << strerror(-r) << std::endl;
+            close(frps_ring_eventfd), frps_ring_eventfd = -1;
+            io_uring_queue_exit(&frps_ring);
+            return false;
+        };
+    Fl::add_fd(frps_ring_eventfd, FL_READ, iouring_event_handler);
+    return true;
+} // end iouring_start
+
+bool
+iouring_attach(connection_st*conn)
+{
+    if (frps_ring_eventfd < 0 || !conn
+            || conn->conn_rank < 0 || conn->conn_rank >= (int)frps_uring_max_connections)
+        return false;
+    /// io_uring gives -EAGAIN on non-blocking files instead of waiting
+    fcntl(conn->conn_cmdfd, F_SETFL, fcntl(conn->conn_cmdfd, F_GETFL) & ~O_NONBLOCK);
+    fcntl(conn->conn_outfd, F_SETFL, fcntl(conn->conn_outfd, F_GETFL) & ~O_NONBLOCK);
+    conn->conn_uring = true;
+    frps_ring_gotinput[conn->conn_rank] = false;
+    iouring_arm(conn, URING_READ);
+    return true;
+} // end iouring_attach
+
+void
+iouring_detach(connection_st*conn)
+{
+    if (!conn || !conn->conn_uring)
+        return;
+    for (uring_op_en op: {URING_READ, URING_WRITE, URING_POLL})
+        {
+            struct io_uring_sqe* sqe = iouring_get_sqe();
+            if (!sqe)
+                break;
+            io_uring_prep_cancel(sqe, uring_userdata(conn, op), 0);
+            io_uring_sqe_set_data(sqe, (void*)frps_uring_ignored);
+        };
+    /// the file descriptors are closed just after, so submit now
+    frps_io_stats.ios_nb_syscalls++;
+    io_uring_submit(&frps_ring);
+    conn->conn_uring = false;
+    conn->conn_uring_writing = false;
+} // end iouring_detach
+
+void
+iouring_flush(connection_st*conn)
+{
+    if (!conn || !conn->conn_uring || conn->conn_uring_writing)
+        return;
+    /// requests appended while a write is in flight are written together
+    if (conn->conn_uring_wbuf.empty())
+        {
+            if (conn->conn_outbuf.empty())
+                return;
+            conn->conn_uring_wbuf.swap(conn->conn_outbuf);
+        };
+    conn->conn_uring_writing = true;
+    iouring_arm(conn, URING_WRITE);
+} // end iouring_flush
+
+#else /* !FLTKRPS_IO_URING */
+
+bool
+iouring_start(void)
+{
+    std::clog << progname << " was built without io_uring (make IO_URING=1)" << std::endl;
+    return false;
+} // end iouring_start
+
+bool
+iouring_attach(connection_st*)
+{
+    return false;
+} // end iouring_attach
+
+void
+iouring_detach(connection_st*)
+{
+} // end iouring_detach
+
+void
+iouring_flush(connection_st*)
+{
+} // end iouring_flush
+
+#endif /* FLTKRPS_IO_URING */
+
+/// end of file iouringfltk.cc
@@ -8,7 +8,10 @@
  *
  **********************************************/
 
-#include "fltkrps.hh"
+#include "jsonrpsfltk.hh"
+
+#include <charconv>
+#include <climits>
 
 /** important NOTICE
  *
@@ -86,34 +89,1267 @@ rps_compute_cstr_two_64bits_hash(int64_t ht[2], const char*cstr, int len)
     return utf8cnt;
 } // end of rps_compute_cstr_two_64bits_hash
 
-#warning guifltk-refpersys/jsonrpsfltk.cc is almost empty should contain JSONCPP related code
+std::vector<connection_st*> vector_connections;
+io_stats_st frps_io_stats;
+/// increasing stamps of uses of cached objects, for all connections
+static long frps_objcache_clock;
+
+connection_st::connection_st(int rank, const std::string& prefix)
+    : conn_rank(rank), conn_fifo_prefix(prefix), conn_state(CONNSTATE_WAITING),
+      conn_cmdfd(-1), conn_outfd(-1),
+      conn_inbuf(), conn_inscanned(0), conn_outbuf(), conn_requests(), conn_last_reqid(0),
+      conn_objcache(), conn_arena(new message_arena), conn_stale_oids(),
+      conn_disconnect_reason(), conn_window(nullptr), conn_statusbox(nullptr),
+      conn_uring(false), conn_uring_writing(false), conn_uring_wbuf()
+{
+    conn_inbuf.reserve(frps_buffer_size);
+} // end connection_st::connection_st
+
+connection_st::~connection_st()
+{
+    close_fifos();
+    if (conn_window)
+        {
+            conn_window->hide();
+            delete conn_window;
+            conn_window = nullptr;
+        }
+    delete conn_arena;
+    conn_arena = nullptr;
+} // end connection_st::~connection_st
+
+/// retry opening the output FIFO till RefPerSys reads it
+static void
+connection_reopen_cb(void*data)
+{
+    connection_st* conn = (connection_st*)data;
+    if (!conn || conn->conn_state != CONNSTATE_WAITING)
+        return;
+    int r = conn->open_output_fifo();
+    if (r == 0)
+        Fl::repeat_timeout(frps_reopen_delay, connection_reopen_cb, data);
+    else if (r < 0)
+        conn->disconnect("cannot open output FIFO");
+} // end connection_reopen_cb
+
+bool
+connection_st::open_fifos(void)
+{
+    std::string cmdfifo= conn_fifo_prefix + ".cmd";
+    /// the command FIFO is opened without blocking, since RefPerSys
+    /// might not have opened it yet for writing
+    conn_cmdfd = open(cmdfifo.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (conn_cmdfd < 0)
+        {
+            int e = errno;
+            std::clog << progname << " pid " << (int)getpid() << " git " << SHORTGIT_ID
+                      << " failed to open command FIFO " << cmdfifo << " for read : " << strerror(e) << std::endl;
+            return false;
+        };
+    conn_state = CONNSTATE_WAITING;
+    int r = open_output_fifo();
+    if (r < 0)
+        {
+            close(conn_cmdfd), conn_cmdfd = -1;
+            return false;
+        };
+    /// one RefPerSys not yet running should not block the others
+    if (r == 0)
+        {
+            std::clog << progname << " connection#" << conn_rank << " waiting for RefPerSys to read "
+                      << conn_fifo_prefix << ".out" << std::endl;
+            Fl::add_timeout(frps_reopen_delay, connection_reopen_cb, (void*)this);
+        };
+    return true;
+} // end connection_st::open_fifos
+
+int
+connection_st::open_output_fifo(void)
+{
+    std::string cmdfifo= conn_fifo_prefix + ".cmd";
+    std::string outfifo= conn_fifo_prefix + ".out";
+    /// a non-blocking open for writing fails with ENXIO while nobody
+    /// reads the FIFO, and writes should never block the GUI
+    conn_outfd = open(outfifo.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (conn_outfd < 0)
+        {
+            int e = errno;
+            if (e == ENXIO || e == EINTR)
+                return 0;
+            std::clog << progname << " pid " << (int)getpid() << " git " << SHORTGIT_ID
+                      << " failed to open output FIFO " << outfifo << " for write : " << strerror(e) << std::endl;
+            return -1;
+        };
+    conn_state = CONNSTATE_CONNECTED;
+    show_state();
+    if (use_io_uring && iouring_attach(this))
+        iouring_flush(this);
+    else
+        {
+            Fl::add_fd(conn_cmdfd, FL_READ, cmd_fd_handler, (void*)this);
+            if (!conn_outbuf.empty())
+                Fl::add_fd(conn_outfd, FL_WRITE, out_fd_handler, (void*)this);
+        };
+    std::clog << progname << " connection#" << conn_rank << " using FIFOs "
+              << cmdfifo << " & " << outfifo
+              << (conn_uring?" with io_uring":"") << std::endl;
+    return 1;
+} // end connection_st::open_output_fifo
 
 void
-out_fd_handler(int fd, void*data)
+connection_st::close_fifos(void)
 {
-    char buf[frps_buffer_size+4];
-    memset (buf, 0, sizeof(buf));
-    ssize_t nb = read(fd, buf, frps_buffer_size);
+    Fl::remove_timeout(connection_reopen_cb, (void*)this);
+    if (conn_uring)
+        iouring_detach(this);
+    if (conn_cmdfd >= 0)
+        {
+            Fl::remove_fd(conn_cmdfd);
+            close(conn_cmdfd);
+            conn_cmdfd = -1;
+        };
+    if (conn_outfd >= 0)
+        {
+            Fl::remove_fd(conn_outfd);
+            close(conn_outfd);
+            conn_outfd = -1;
+        };
+} // end connection_st::close_fifos
+
+void
+connection_st::disconnect(const char*why)
+{
+    if (conn_state == CONNSTATE_DISCONNECTED)
+        return;
+    std::clog << progname << " connection#" << conn_rank << " to "
+              << conn_fifo_prefix << " disconnected: " << why << std::endl;
+    close_fifos();
+    conn_state = CONNSTATE_DISCONNECTED;
+    conn_disconnect_reason = why;
+    show_state();
+} // end connection_st::disconnect
+
+void
+connection_st::show_state(void)
+{
+    static const char*const statenames[] = {"waiting for RefPerSys", "connected", "disconnected"};
+    if (!conn_statusbox)
+        return;
+    std::string lab = conn_fifo_prefix + " : " + statenames[conn_state];
+    if (conn_state == CONNSTATE_DISCONNECTED && !conn_disconnect_reason.empty())
+        lab += " (" + conn_disconnect_reason + ")";
+    conn_statusbox->copy_label(lab.c_str());
+    conn_statusbox->redraw();
+} // end connection_st::show_state
+
+long
+connection_st::send_request(const std::string& method, const std::string& jsonparams,
+                            json_reply_handler_t handler, json_failure_handler_t failure)
+{
+    long id = ++conn_last_reqid;
+    std::string req;
+    req.reserve(64 + method.size() + jsonparams.size());
+    json_writer wr(req);
+    wr.begin_object();
+    wr.key("jsonrpc");
+    wr.write_string("2.0");
+    wr.key("method");
+    wr.write_string(method);
+    if (!jsonparams.empty())
+        {
+            wr.key("params");
+            wr.write_raw(jsonparams);
+        };
+    wr.key("id");
+    wr.write_int(id);
+    wr.end_object();
+    conn_requests[id] = pending_request_st {method, handler, failure};
+    send_message(req);
+    return id;
+} // end connection_st::send_request
+
+void
+connection_st::send_reply(std::string_view jsonid, const std::string& jsonresult)
+{
+    std::string rep;
+    json_writer wr(rep);
+    wr.begin_object();
+    wr.key("jsonrpc");
+    wr.write_string("2.0");
+    wr.key("result");
+    wr.write_raw(jsonresult.empty()?"null":jsonresult);
+    wr.key("id");
+    wr.write_raw(jsonid);
+    wr.end_object();
+    send_message(rep);
+} // end connection_st::send_reply
+
+void
+connection_st::send_error(std::string_view jsonid, int code, const std::string& message)
+{
+    std::string rep;
+    json_writer wr(rep);
+    wr.begin_object();
+    wr.key("jsonrpc");
+    wr.write_string("2.0");
+    wr.key("error");
+    wr.begin_object();
+    wr.key("code");
+    wr.write_int(code);
+    wr.key("message");
+    wr.write_string(message);
+    wr.end_object();
+    wr.key("id");
+    wr.write_raw(jsonid);
+    wr.end_object();
+    send_message(rep);
+} // end connection_st::send_error
+
+void
+connection_st::send_message(const std::string& msg)
+{
+    bool wasempty = conn_outbuf.empty();
+    conn_outbuf.append(msg);
+    conn_outbuf.push_back(frps_message_terminator);
+    if (conn_uring)
+        iouring_flush(this);
+    else if (wasempty && conn_outfd >= 0)
+        Fl::add_fd(conn_outfd, FL_WRITE, out_fd_handler, (void*)this);
+} // end connection_st::send_message
+
+void
+connection_st::handle_input(int fd)
+{
+    /// only the GUI thread reads FIFOs, so one buffer serves them all
+    static char buf[frps_read_size+4];
+    /// one wakeup of the event loop, and one read
+    frps_io_stats.ios_nb_syscalls += 2;
+    ssize_t nb = read(fd, buf, frps_read_size);
     if (nb<0)
         {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            std::clog << progname << " connection#" << conn_rank
+                      << " failed to read command FIFO " << conn_fifo_prefix << ".cmd :"
+                      << strerror(errno) << std::endl;
+            disconnect("read error");
+            return;
         }
     else if (nb==0)
         {
-            // end of file
-            Fl::remove_fd(fd);
-        }
+            /// RefPerSys closed its command FIFO
+            disconnect("end of file");
+            return;
+        };
+    consume_input(buf, nb);
+} // end connection_st::handle_input
+
+void
+connection_st::consume_input(const char*buf, size_t nb)
+{
+    frps_io_stats.ios_nb_inbytes += nb;
+    conn_inbuf.append(buf, nb);
+    /// a long message is scanned once, not again after each read
+    std::string::size_type start = 0, end = 0;
+    while ((end = conn_inbuf.find(frps_message_terminator, std::max(start, conn_inscanned)))
+            != std::string::npos)
+        {
+            frps_io_stats.ios_nb_messages++;
+            process_message(std::string_view(conn_inbuf).substr(start, end-start));
+            conn_arena->reset();
+            start = end+1;
+        };
+    conn_inbuf.erase(0, start);
+    conn_inscanned = conn_inbuf.size();
+    if (conn_inscanned > frps_max_message_size)
+        {
+            std::clog << progname << " connection#" << conn_rank
+                      << " got more than " << frps_max_message_size
+                      << " bytes without message terminator" << std::endl;
+            conn_inbuf.clear();
+            conn_inbuf.shrink_to_fit();
+            conn_inscanned = 0;
+            disconnect("message too big");
+        };
+} // end connection_st::consume_input
+
+void
+connection_st::handle_output(int fd)
+{
+    if (conn_outbuf.empty())
+        {
+            Fl::remove_fd(fd, FL_WRITE);
+            return;
+        };
+    frps_io_stats.ios_nb_syscalls += 2;
+    ssize_t nb = write(fd, conn_outbuf.data(), conn_outbuf.size());
+    if (nb<0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            std::clog << progname << " connection#" << conn_rank
+                      << " failed to write output FIFO " << conn_fifo_prefix << ".out :"
+                      << strerror(errno) << std::endl;
+            disconnect("write error");
+            return;
+        };
+    frps_io_stats.ios_nb_outbytes += nb;
+    conn_outbuf.erase(0, nb);
+    if (conn_outbuf.empty())
+        Fl::remove_fd(fd, FL_WRITE);
+} // end connection_st::handle_output
+
+/// std::less<> to find methods by string_view, without a copy per message
+static std::map<std::string, json_method_handler_t, std::less<>> json_method_handlers;
+static std::map<std::string, generic_json_handler_t*, std::less<>> generic_json_handlers;
+
+void
+register_json_method_handler(const char*method, json_method_handler_t handler)
+{
+    if (!method || !method[0])
+        return;
+    if (handler)
+        json_method_handlers[method] = handler;
     else
+        json_method_handlers.erase(method);
+} // end register_json_method_handler
+
+void
+register_generic_json_handler(const char*method, generic_json_handler_t*handler)
+{
+    if (!method || !method[0])
+        return;
+    if (handler)
+        generic_json_handlers[method] = handler;
+    else
+        generic_json_handlers.erase(method);
+} // end register_generic_json_handler
+
+/* The message is scanned once, keeping the text of its params,
+   result or error, which are then decoded by the typed handler of
+   the method or of the pending request. */
+void
+connection_st::process_message(std::string_view msg)
+{
+    std::pmr::memory_resource* arena = conn_arena->resource();
+    json_reader rd(msg, arena);
+    std::pmr::string method(arena);
+    std::string_view params, result, error;
+    /// the JSON text of the id, which may be a number or a string
+    std::string_view jsonid;
+    bool hasid = false;
+    std::string_view key;
+    if (rd.begin_object())
+        while (rd.next_member(key))
+            {
+                bool good = true;
+                if (key == "method")
+                    good = json_decode(rd, method);
+                else if (key == "id")
+                    {
+                        char c = rd.peek();
+                        if (c == '"' || c == '-' || (c >= '0' && c <= '9'))
+                            good = hasid = rd.raw_value(jsonid);
+                        else
+                            good = rd.accept_null() || rd.fail("expecting number or string id");
+                    }
+                else if (key == "params")
+                    good = rd.raw_value(params);
+                else if (key == "result")
+                    good = rd.raw_value(result);
+                else if (key == "error")
+                    good = rd.raw_value(error);
+                else
+                    good = rd.skip_value();
+                if (!good)
+                    break;
+            };
+    if (rd.ok() && !rd.at_end())
+        rd.fail("garbage after message");
+    if (!rd.ok())
         {
-#warning should do something with buf
-        }
+            std::clog << progname << " connection#" << conn_rank
+                      << " got invalid JSON message: " << rd.error()
+                      << " at " << rd.position() << std::endl;
+            /// JSONRPC 2.0 answers a parse error with a null id
+            send_error("null", -32700, std::string("parse error: ") + rd.error());
+            return;
+        };
+    if (!method.empty())
+        {
+            /// a request, or a notification without id, from RefPerSys
+            if (params.empty())
+                params = "{}";
+            std::string res;
+            auto typit = json_method_handlers.find(std::string_view(method));
+            if (typit != json_method_handlers.end())
+                {
+                    json_reader prd(params, arena);
+                    json_writer wr(res);
+                    if (!typit->second(this, prd, wr))
+                        {
+                            if (hasid)
+                                send_error(jsonid, prd.ok()?-32000:-32602,
+                                           (prd.ok()?"failed ":"invalid params for ") + std::string(method));
+                            return;
+                        };
+                }
+            else
+                {
+                    auto genit = generic_json_handlers.find(std::string_view(method));
+                    if (genit == generic_json_handlers.end())
+                        {
+                            std::clog << progname << " connection#" << conn_rank
+                                      << " got unknown method " << method << std::endl;
+                            if (hasid)
+                                send_error(jsonid, -32601, "unknown method " + std::string(method));
+                            return;
+                        };
+                    Json::Value jparams, jresult;
+                    json_reader prd(params, arena);
+                    if (!json_decode(prd, jparams) || !(*genit->second)(this, jparams, jresult))
+                        {
+                            if (hasid)
+                                send_error(jsonid, -32000, "failed " + std::string(method));
+                            return;
+                        };
+                    json_writer wr(res);
+                    json_encode(wr, jresult);
+                };
+            if (hasid)
+                send_reply(jsonid, res);
+            return;
+        };
+    if (!hasid)
+        {
+            std::clog << progname << " connection#" << conn_rank
+                      << " got message without method nor id" << std::endl;
+            return;
+        };
+    /// our own requests have integer ids
+    int64_t id = -1;
+    auto idres = std::from_chars(jsonid.data(), jsonid.data()+jsonid.size(), id);
+    auto it = conn_requests.end();
+    if (idres.ec == std::errc() && idres.ptr == jsonid.data()+jsonid.size())
+        it = conn_requests.find(id);
+    if (it == conn_requests.end())
+        {
+            std::clog << progname << " connection#" << conn_rank
+                      << " got reply to unexpected request " << jsonid << std::endl;
+            return;
+        };
+    pending_request_st preq = std::move(it->second);
+    conn_requests.erase(it);
+    if (!error.empty())
+        {
+            std::string errmsg;
+            json_string_member(error, "message", errmsg, arena);
+            std::clog << progname << " connection#" << conn_rank
+                      << " request #" << id << " " << preq.preq_method
+                      << " failed: " << errmsg << std::endl;
+            if (preq.preq_failure)
+                preq.preq_failure(this, errmsg);
+            return;
+        };
+    /// the cache outlives the message, so gets promoted copies
+    std::string oid;
+    if (json_string_member(result, "oid", oid, arena))
+        cache_object(oid, std::string(result));
+    if (preq.preq_handler)
+        {
+            json_reader rrd(result, arena);
+            preq.preq_handler(this, rrd);
+        };
+} // end connection_st::process_message
+
+void
+connection_st::cache_object(const std::string& oid, std::string json)
+{
+    cached_object_st& co = conn_objcache[oid];
+    co.co_json = std::move(json);
+    co.co_stamp = ++frps_objcache_clock;
+} // end connection_st::cache_object
+
+const std::string*
+connection_st::cached_object(const std::string& oid)
+{
+    auto it = conn_objcache.find(oid);
+    if (it == conn_objcache.end())
+        return nullptr;
+    it->second.co_stamp = ++frps_objcache_clock;
+    return &it->second.co_json;
+} // end connection_st::cached_object
+
+void
+out_fd_handler(int fd, void*data)
+{
+    connection_st* conn = (connection_st*)data;
+    if (conn)
+        conn->handle_output(fd);
 } // end out_fd_handler
 
 void
 cmd_fd_handler(int fd, void*data)
 {
-    char buf[frps_buffer_size];
-    memset (buf, 0, sizeof(buf));
-#warning cmd_fd_handler has to be coded
+    connection_st* conn = (connection_st*)data;
+    if (conn)
+        conn->handle_input(fd);
 } // end cmd_fd_handler
 
-/* TODO: add code to communicate by JSONRPC with refpersys */
+////////////////////////////////////////////////////////////////
+//// the JSON reader
+
+json_reader::json_reader(std::string_view text, std::pmr::memory_resource*arena)
+    : jr_text(text), jr_pos(0), jr_error(nullptr), jr_errpos(0),
+      jr_arena(arena?arena:std::pmr::get_default_resource()),
+      jr_key(jr_arena), jr_first(jr_arena)
+{
+} // end json_reader::json_reader
+
+bool
+json_reader::fail(const char*why)
+{
+    if (!jr_error)
+        {
+            jr_error = why;
+            jr_errpos = jr_pos;
+        };
+    return false;
+} // end json_reader::fail
+
+void
+json_reader::skip_space(void)
+{
+    size_t len = jr_text.size();
+    while (jr_pos < len)
+        {
+            char c = jr_text[jr_pos];
+            if (c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f')
+                jr_pos++;
+            else if (c == '/' && jr_pos+1 < len && jr_text[jr_pos+1] == '/')
+                {
+                    size_t eol = jr_text.find('\n', jr_pos);
+                    jr_pos = (eol == std::string_view::npos)?len:eol+1;
+                }
+            else
+                break;
+        };
+} // end json_reader::skip_space
+
+bool
+json_reader::at_end(void)
+{
+    skip_space();
+    return jr_pos >= jr_text.size();
+} // end json_reader::at_end
+
+char
+json_reader::peek(void)
+{
+    skip_space();
+    if (jr_error || jr_pos >= jr_text.size())
+        return (char)0;
+    return jr_text[jr_pos];
+} // end json_reader::peek
+
+bool
+json_reader::accept_null(void)
+{
+    if (peek() == 'n' && jr_text.substr(jr_pos, 4) == "null")
+        {
+            jr_pos += 4;
+            return true;
+        };
+    return false;
+} // end json_reader::accept_null
+
+bool
+json_reader::begin_object(void)
+{
+    if (peek() != '{')
+        return fail("expecting object");
+    jr_pos++;
+    jr_first.push_back(true);
+    return true;
+} // end json_reader::begin_object
+
+bool
+json_reader::next_member(std::string_view& key)
+{
+    if (jr_error || jr_first.empty())
+        return false;
+    char c = peek();
+    if (c == '}')
+        {
+            jr_pos++;
+            jr_first.pop_back();
+            return false;
+        };
+    if (jr_first.back())
+        jr_first.back() = false;
+    else if (c == ',')
+        {
+            jr_pos++;
+            skip_space();
+        }
+    else
+        return fail("expecting comma or closing brace");
+    if (!scan_string(key, jr_key))
+        return false;
+    if (peek() != ':')
+        return fail("expecting colon");
+    jr_pos++;
+    return true;
+} // end json_reader::next_member
+
+bool
+json_reader::begin_array(void)
+{
+    if (peek() != '[')
+        return fail("expecting array");
+    jr_pos++;
+    jr_first.push_back(true);
+    return true;
+} // end json_reader::begin_array
+
+bool
+json_reader::next_element(void)
+{
+    if (jr_error || jr_first.empty())
+        return false;
+    char c = peek();
+    if (c == ']')
+        {
+            jr_pos++;
+            jr_first.pop_back();
+            return false;
+        };
+    if (jr_first.back())
+        jr_first.back() = false;
+    else if (c == ',')
+        jr_pos++;
+    else
+        return fail("expecting comma or closing bracket");
+    return true;
+} // end json_reader::next_element
+
+/* Give in sv the content of the string at the current position.  It
+   is a view into the text when there is no escape, else into the
+   unescaped scratch string. */
+template<typename Str>
+bool
+json_reader::scan_string(std::string_view& sv, Str& scratch)
+{
+    if (peek() != '"')
+        return fail("expecting string");
+    size_t start = ++jr_pos;
+    size_t len = jr_text.size();
+    size_t end = start;
+    /// RFC 8259 wants control characters escaped in strings
+    while (end < len && jr_text[end] != '"' && jr_text[end] != '\\'
+            && (uint8_t)jr_text[end] >= 0x20)
+        end++;
+    if (end >= len)
+        return fail("unterminated string");
+    if ((uint8_t)jr_text[end] < 0x20)
+        return fail("control character in string");
+    if (jr_text[end] == '"')
+        {
+            sv = jr_text.substr(start, end-start);
+            jr_pos = end+1;
+            return true;
+        };
+    scratch.assign(jr_text.data()+start, end-start);
+    jr_pos = end;
+    while (jr_pos < len)
+        {
+            char c = jr_text[jr_pos++];
+            if (c == '"')
+                {
+                    sv = scratch;
+                    return true;
+                };
+            if ((uint8_t)c < 0x20)
+                return fail("control character in string");
+            if (c != '\\')
+                {
+                    scratch.push_back(c);
+                    continue;
+                };
+            if (jr_pos >= len)
+                break;
+            c = jr_text[jr_pos++];
+            switch (c)
+                {
+                case '"':
+                case '\\':
+                case '/':
+                    scratch.push_back(c);
+                    break;
+                case 'b':
+                    scratch.push_back('\b');
+                    break;
+                case 'f':
+                    scratch.push_back('\f');
+                    break;
+                case 'n':
+                    scratch.push_back('\n');
+                    break;
+                case 'r':
+                    scratch.push_back('\r');
+                    break;
+                case 't':
+                    scratch.push_back('\t');
+                    break;
+                case 'u':
+                {
+                    auto hex4 = [&](unsigned& u)
+                    {
+                        if (jr_pos+4 > len)
+                            return false;
+                        auto r = std::from_chars(jr_text.data()+jr_pos, jr_text.data()+jr_pos+4, u, 16);
+                        if (r.ptr != jr_text.data()+jr_pos+4)
+                            return false;
+                        jr_pos += 4;
+                        return true;
+                    };
+                    unsigned u = 0;
+                    if (!hex4(u))
+                        return fail("bad \\u escape");
+                    ucs4_t uc = u;
+                    if (u >= 0xd800 && u < 0xdc00)
+                        {
+                            unsigned lo = 0;
+                            if (jr_pos+2 > len || jr_text[jr_pos] != '\\' || jr_text[jr_pos+1] != 'u')
+                                return fail("missing low surrogate");
+                            jr_pos += 2;
+                            if (!hex4(lo) || lo < 0xdc00 || lo >= 0xe000)
+                                return fail("bad low surrogate");
+                            uc = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+                        };
+                    uint8_t u8buf[8];
+                    int u8len = u8_uctomb(u8buf, uc, sizeof(u8buf));
+                    if (u8len <= 0)
+                        return fail("bad unicode escape");
+                    scratch.append((const char*)u8buf, u8len);
+                }
+                break;
+                default:
+                    return fail("bad escape in string");
+                };
+        };
+    return fail("unterminated string");
+} // end json_reader::scan_string
+
+bool
+json_reader::read_string(std::string& str)
+{
+    std::string_view sv;
+    if (!scan_string(sv, str))
+        return false;
+    if (sv.data() != str.data())
+        str.assign(sv);
+    return true;
+} // end json_reader::read_string
+
+bool
+json_reader::read_string_view(std::string_view& sv)
+{
+    return scan_string(sv, jr_key);
+} // end json_reader::read_string_view
+
+/* std::from_chars also accepts inf, nan, leading zeros and hex
+   floats, so the JSON grammar is checked first:
+   -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+size_t
+json_reader::scan_number(bool& integral)
+{
+    peek();
+    size_t len = jr_text.size();
+    size_t pos = jr_pos;
+    auto isdig = [&](size_t p)
+    {
+        return p < len && jr_text[p] >= '0' && jr_text[p] <= '9';
+    };
+    integral = true;
+    if (pos < len && jr_text[pos] == '-')
+        pos++;
+    if (!isdig(pos))
+        return 0;
+    if (jr_text[pos] == '0')
+        pos++;
+    else
+        while (isdig(pos))
+            pos++;
+    if (pos < len && jr_text[pos] == '.')
+        {
+            integral = false;
+            if (!isdig(++pos))
+                return 0;
+            while (isdig(pos))
+                pos++;
+        };
+    if (pos < len && (jr_text[pos] == 'e' || jr_text[pos] == 'E'))
+        {
+            integral = false;
+            pos++;
+            if (pos < len && (jr_text[pos] == '+' || jr_text[pos] == '-'))
+                pos++;
+            if (!isdig(pos))
+                return 0;
+            while (isdig(pos))
+                pos++;
+        };
+    /// so 01 or 1x are not taken as 0 or 1 followed by garbage
+    if (pos < len && (isalnum((unsigned char)jr_text[pos]) || jr_text[pos] == '.'
+                      || jr_text[pos] == '+' || jr_text[pos] == '-'))
+        return 0;
+    return pos - jr_pos;
+} // end json_reader::scan_number
+
+bool
+json_reader::read_int64(int64_t& i)
+{
+    bool integral = false;
+    size_t numlen = scan_number(integral);
+    if (!numlen || !integral)
+        return fail("expecting integer");
+    const char*start = jr_text.data()+jr_pos;
+    auto r = std::from_chars(start, start+numlen, i);
+    if (r.ec != std::errc() || r.ptr != start+numlen)
+        return fail("integer out of range");
+    jr_pos += numlen;
+    return true;
+} // end json_reader::read_int64
+
+bool
+json_reader::read_double(double& d)
+{
+    bool integral = false;
+    size_t numlen = scan_number(integral);
+    if (!numlen)
+        return fail("expecting number");
+    const char*start = jr_text.data()+jr_pos;
+    auto r = std::from_chars(start, start+numlen, d);
+    if (r.ec != std::errc() || r.ptr != start+numlen)
+        return fail("number out of range");
+    jr_pos += numlen;
+    return true;
+} // end json_reader::read_double
+
+bool
+json_reader::read_bool(bool& b)
+{
+    char c = peek();
+    if (c == 't' && jr_text.substr(jr_pos, 4) == "true")
+        {
+            b = true;
+            jr_pos += 4;
+            return true;
+        };
+    if (c == 'f' && jr_text.substr(jr_pos, 5) == "false")
+        {
+            b = false;
+            jr_pos += 5;
+            return true;
+        };
+    return fail("expecting boolean");
+} // end json_reader::read_bool
+
+/// nesting deeper than this is an error, to avoid stack overflow
+constexpr int json_max_depth = 512;
+
+bool
+json_reader::skip_nested(int depth)
+{
+    if (depth > json_max_depth)
+        return fail("too deeply nested");
+    std::string_view sv;
+    switch (peek())
+        {
+        case '{':
+            begin_object();
+            while (next_member(sv))
+                if (!skip_nested(depth+1))
+                    return false;
+            return ok();
+        case '[':
+            begin_array();
+            while (next_element())
+                if (!skip_nested(depth+1))
+                    return false;
+            return ok();
+        case '"':
+            return scan_string(sv, jr_key);
+        case 't':
+        case 'f':
+        {
+            bool b = false;
+            return read_bool(b);
+        }
+        case 'n':
+            return accept_null() || fail("expecting null");
+        default:
+        {
+            bool integral = false;
+            size_t numlen = scan_number(integral);
+            if (!numlen)
+                return fail("expecting value");
+            jr_pos += numlen;
+            return true;
+        }
+        };
+} // end json_reader::skip_nested
+
+bool
+json_reader::skip_value(void)
+{
+    return skip_nested(0);
+} // end json_reader::skip_value
+
+bool
+json_reader::raw_value(std::string_view& raw)
+{
+    peek();
+    size_t start = jr_pos;
+    if (!skip_value())
+        return false;
+    raw = jr_text.substr(start, jr_pos-start);
+    return true;
+} // end json_reader::raw_value
+
+bool
+json_string_member(std::string_view objtext, std::string_view key, std::string& val,
+                   std::pmr::memory_resource*arena)
+{
+    json_reader rd(objtext, arena);
+    std::string_view k;
+    if (rd.peek() != '{' || !rd.begin_object())
+        return false;
+    while (rd.next_member(k))
+        {
+            if (k == key)
+                return rd.peek() == '"' && rd.read_string(val);
+            if (!rd.skip_value())
+                return false;
+        };
+    return false;
+} // end json_string_member
+
+////////////////////////////////////////////////////////////////
+//// the JSON writer
+
+void
+json_writer::separate(void)
+{
+    if (jw_afterkey)
+        jw_afterkey = false;
+    else if (!jw_first.empty())
+        {
+            if (jw_first.back())
+                jw_first.back() = false;
+            else
+                jw_out.push_back(',');
+        };
+} // end json_writer::separate
+
+void
+json_writer::begin_object(void)
+{
+    separate();
+    jw_out.push_back('{');
+    jw_first.push_back(true);
+} // end json_writer::begin_object
+
+void
+json_writer::key(std::string_view k)
+{
+    separate();
+    append_quoted(k);
+    jw_out.push_back(':');
+    jw_afterkey = true;
+} // end json_writer::key
+
+void
+json_writer::end_object(void)
+{
+    jw_out.push_back('}');
+    if (!jw_first.empty())
+        jw_first.pop_back();
+} // end json_writer::end_object
+
+void
+json_writer::begin_array(void)
+{
+    separate();
+    jw_out.push_back('[');
+    jw_first.push_back(true);
+} // end json_writer::begin_array
+
+void
+json_writer::end_array(void)
+{
+    jw_out.push_back(']');
+    if (!jw_first.empty())
+        jw_first.pop_back();
+} // end json_writer::end_array
+
+void
+json_writer::write_null(void)
+{
+    separate();
+    jw_out.append("null");
+} // end json_writer::write_null
+
+void
+json_writer::write_bool(bool b)
+{
+    separate();
+    jw_out.append(b?"true":"false");
+} // end json_writer::write_bool
+
+void
+json_writer::write_int(int64_t i)
+{
+    separate();
+    char buf[32];
+    auto r = std::to_chars(buf, buf+sizeof(buf), i);
+    jw_out.append(buf, r.ptr-buf);
+} // end json_writer::write_int
+
+void
+json_writer::write_double(double d)
+{
+    separate();
+    char buf[48];
+    memset (buf, 0, sizeof(buf));
+    snprintf(buf, sizeof(buf), "%.17g", d);
+    /// keep it a JSON floating point number
+    if (!strpbrk(buf, ".eEn"))
+        strcat(buf, ".0");
+    jw_out.append(buf);
+} // end json_writer::write_double
+
+void
+json_writer::write_string(std::string_view s)
+{
+    separate();
+    append_quoted(s);
+} // end json_writer::write_string
+
+void
+json_writer::append_quoted(std::string_view s)
+{
+    jw_out.push_back('"');
+    for (char c: s)
+        {
+            switch (c)
+                {
+                case '"':
+                    jw_out.append("\\\"");
+                    break;
+                case '\\':
+                    jw_out.append("\\\\");
+                    break;
+                case '\n':
+                    jw_out.append("\\n");
+                    break;
+                case '\t':
+                    jw_out.append("\\t");
+                    break;
+                case '\r':
+                    jw_out.append("\\r");
+                    break;
+                case '\f':
+                    jw_out.append("\\f");
+                    break;
+                default:
+                    if ((unsigned char)c < ' ')
+                        {
+                            char buf[8];
+                            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)c);
+                            jw_out.append(buf);
+                        }
+                    else
+                        jw_out.push_back(c);
+                };
+        };
+    jw_out.push_back('"');
+} // end json_writer::append_quoted
+
+void
+json_writer::write_raw(std::string_view raw)
+{
+    separate();
+    jw_out.append(raw);
+} // end json_writer::write_raw
+
+////////////////////////////////////////////////////////////////
+//// decoding and encoding of scalars
+
+bool
+json_decode(json_reader& rd, std::string& s)
+{
+    return rd.read_string(s);
+} // end json_decode for strings
+
+bool
+json_decode(json_reader& rd, int64_t& i)
+{
+    return rd.read_int64(i);
+} // end json_decode for int64_t
+
+bool
+json_decode(json_reader& rd, int& i)
+{
+    int64_t l = 0;
+    if (!rd.read_int64(l))
+        return false;
+    if (l < INT_MIN || l > INT_MAX)
+        return rd.fail("integer overflow");
+    i = (int)l;
+    return true;
+} // end json_decode for int
+
+bool
+json_decode(json_reader& rd, double& d)
+{
+    return rd.read_double(d);
+} // end json_decode for double
+
+bool
+json_decode(json_reader& rd, bool& b)
+{
+    return rd.read_bool(b);
+} // end json_decode for bool
+
+bool
+json_decode(json_reader& rd, std::pmr::string& s)
+{
+    std::string_view sv;
+    if (!rd.read_string_view(sv))
+        return false;
+    s.assign(sv.data(), sv.size());
+    return true;
+} // end json_decode for arena strings
+
+bool
+json_decode(json_reader& rd, Json::Value& jv)
+{
+    std::string_view raw;
+    if (!rd.raw_value(raw))
+        return false;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string errs;
+    if (!reader->parse(raw.data(), raw.data()+raw.size(), &jv, &errs))
+        return rd.fail("invalid JSON for Json::Value");
+    return true;
+} // end json_decode for Json::Value
+
+void
+json_encode(json_writer& wr, const std::string& s)
+{
+    wr.write_string(s);
+} // end json_encode for strings
+
+void
+json_encode(json_writer& wr, const std::pmr::string& s)
+{
+    wr.write_string(s);
+} // end json_encode for arena strings
+
+void
+json_encode(json_writer& wr, int64_t i)
+{
+    wr.write_int(i);
+} // end json_encode for int64_t
+
+void
+json_encode(json_writer& wr, int i)
+{
+    wr.write_int(i);
+} // end json_encode for int
+
+void
+json_encode(json_writer& wr, double d)
+{
+    wr.write_double(d);
+} // end json_encode for double
+
+void
+json_encode(json_writer& wr, bool b)
+{
+    wr.write_bool(b);
+} // end json_encode for bool
+
+void
+json_encode(json_writer& wr, const Json::Value& jv)
+{
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    wr.write_raw(Json::writeString(builder, jv));
+} // end json_encode for Json::Value
+
+void
+message_arena::reset(void)
+{
+    frps_io_stats.ios_nb_arena_allocs += ma_counting.cr_nb_allocs;
+    frps_io_stats.ios_nb_arena_bytes += ma_counting.cr_nb_bytes;
+    if (ma_counting.cr_nb_allocs > frps_io_stats.ios_max_arena_allocs)
+        frps_io_stats.ios_max_arena_allocs = ma_counting.cr_nb_allocs;
+    ma_counting.cr_nb_allocs = 0;
+    ma_counting.cr_nb_bytes = 0;
+    ma_monotonic.release();
+} // end message_arena::reset
+
+void
+register_builtin_json_methods(void)
+{
+    register_json_method(gui_version_method,
+                         [](connection_st*, const empty_params_st&, version_result_st& res)
+    {
+        res.gitid = GIT_ID;
+        res.host = myhostname;
+        res.pid = (int64_t)getpid();
+        return true;
+    });
+    register_json_method(gui_known_names_method,
+                         [](connection_st*, const names_params_st& par, empty_params_st&)
+    {
+        completion_add_names(json_promote(par.names));
+        return true;
+    });
+} // end register_builtin_json_methods
+
+/// compare the I/O backends: system calls per message, and CPU time per megabyte
+void
+show_io_stats(void)
+{
+    struct rusage ru;
+    memset (&ru, 0, sizeof(ru));
+    getrusage(RUSAGE_SELF, &ru);
+    double cputime = ru.ru_utime.tv_sec + 1.0e-6*ru.ru_utime.tv_usec
+                     + ru.ru_stime.tv_sec + 1.0e-6*ru.ru_stime.tv_usec;
+    double megabytes = (frps_io_stats.ios_nb_inbytes + frps_io_stats.ios_nb_outbytes) / (1024.0*1024.0);
+    char buf[256];
+    memset (buf, 0, sizeof(buf));
+    snprintf(buf, sizeof(buf),
+             "about %ld syscalls, %ld messages, %ld bytes in, %ld bytes out,"
+             " %.2f syscalls/message, %.3f CPU s/MB for the whole process",
+             frps_io_stats.ios_nb_syscalls, frps_io_stats.ios_nb_messages,
+             frps_io_stats.ios_nb_inbytes, frps_io_stats.ios_nb_outbytes,
+             frps_io_stats.ios_nb_messages
+             ? (double)frps_io_stats.ios_nb_syscalls / frps_io_stats.ios_nb_messages : 0.0,
+             megabytes > 0.0 ? cputime / megabytes : 0.0);
+    std::clog << progname << " I/O with " << (use_io_uring?"io_uring":"poll")
+              << ": " << buf << std::endl;
+    memset (buf, 0, sizeof(buf));
+    snprintf(buf, sizeof(buf),
+             "%ld arena allocations of %ld bytes, %.2f allocations/message, at most %ld",
+             frps_io_stats.ios_nb_arena_allocs, frps_io_stats.ios_nb_arena_bytes,
+             frps_io_stats.ios_nb_messages
+             ? (double)frps_io_stats.ios_nb_arena_allocs / frps_io_stats.ios_nb_messages : 0.0,
+             frps_io_stats.ios_max_arena_allocs);
+    std::clog << progname << " messages decoded with " << buf << std::endl;
+} // end show_io_stats
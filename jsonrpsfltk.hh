@@ -0,0 +1,541 @@
+/****** file guifltk-refpersys/jsonrpsfltk.hh ******
+ * SPDX-License-Identifier: MIT
+ * © Copyright 2023 The  Reflective Persistent System Team
+ ***************************************************/
+
+#ifndef JSONRPSFLTK_INCLUDED
+#define JSONRPSFLTK_INCLUDED 1
+
+#include "fltkrps.hh"
+
+/// C++ standard headers
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+/* Typed JSONRPC messages, without any Json::Value tree.
+ *
+ * A message type is declared once, as a json_method giving its
+ * method name, its params struct and its result struct.  Each of
+ * these structs lists its JSON members in a static json_fields()
+ * function, e.g.
+ *
+ *   struct oid_params_st
+ *   {
+ *       std::string oid;
+ *       static constexpr auto json_fields()
+ *       {
+ *           return std::make_tuple(FRPS_JSON_FIELD(oid_params_st, oid));
+ *       };
+ *   };
+ *
+ * and the json_decode and json_encode templates are instantiated
+ * from that, reading the FIFO bytes directly into the structs.
+ * Unknown methods, e.g. for plugins, still get a Json::Value thru
+ * register_generic_json_handler.
+ *
+ * Each message is decoded in the message_arena of its connection,
+ * released in one step once the message is handled.  A struct with
+ * std::pmr::string or std::pmr::vector members declares an
+ * allocator_type and a constructor taking it, following the
+ * uses-allocator convention of std::pmr, so that the params and
+ * results built by json_construct have their members in that arena.
+ * They are only valid while handling the message; json_promote
+ * copies them for long-lived data like caches. */
+
+
+constexpr unsigned frps_arena_initial_size = 4*frps_buffer_size;
+
+/// counts the allocations made in a message arena
+class counting_resource : public std::pmr::memory_resource
+{
+    std::pmr::memory_resource* cr_upstream;
+public:
+    long cr_nb_allocs;
+    long cr_nb_bytes;
+    explicit counting_resource(std::pmr::memory_resource*upstream)
+        : cr_upstream(upstream), cr_nb_allocs(0), cr_nb_bytes(0) {};
+protected:
+    void* do_allocate(size_t bytes, size_t align) override
+    {
+        cr_nb_allocs++;
+        cr_nb_bytes += bytes;
+        return cr_upstream->allocate(bytes, align);
+    };
+    void do_deallocate(void*ptr, size_t bytes, size_t align) override
+    {
+        cr_upstream->deallocate(ptr, bytes, align);
+    };
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    };
+};
+
+/* A monotonic arena for the data decoded from one message, whose
+   initial buffer is reused for every message of the connection. */
+class message_arena
+{
+    alignas(std::max_align_t) char ma_initial[frps_arena_initial_size];
+    std::pmr::monotonic_buffer_resource ma_monotonic;
+    counting_resource ma_counting;
+public:
+    message_arena()
+        : ma_monotonic(ma_initial, sizeof(ma_initial), std::pmr::new_delete_resource()),
+          ma_counting(&ma_monotonic) {};
+    message_arena(const message_arena&) = delete;
+    message_arena& operator = (const message_arena&) = delete;
+    std::pmr::memory_resource* resource(void)
+    {
+        return &ma_counting;
+    };
+    /// release everything allocated for the last message, updating frps_io_stats
+    void reset(void);
+};
+
+
+/// a pull parser over the text of one JSON message
+class json_reader
+{
+    std::string_view jr_text;
+    size_t jr_pos;
+    const char* jr_error;
+    size_t jr_errpos;
+    std::pmr::memory_resource* jr_arena;
+    /// scratch buffer for keys and strings with escapes
+    std::pmr::string jr_key;
+    /// for each nested object or array, true before its first member
+    std::pmr::vector<bool> jr_first;
+    template<typename Str> bool scan_string(std::string_view& sv, Str& scratch);
+    bool skip_nested(int depth);
+    /// the length of the JSON number at the current position, or 0
+    size_t scan_number(bool& integral);
+public:
+    /// without arena, the default memory resource is used
+    explicit json_reader(std::string_view text,
+                         std::pmr::memory_resource*arena = nullptr);
+    std::pmr::memory_resource* arena(void) const
+    {
+        return jr_arena;
+    };
+    bool ok(void) const
+    {
+        return jr_error == nullptr;
+    };
+    const char* error(void) const
+    {
+        return jr_error;
+    };
+    size_t position(void) const
+    {
+        return jr_error?jr_errpos:jr_pos;
+    };
+    std::string_view text(void) const
+    {
+        return jr_text;
+    };
+    /// record the first error and return false
+    bool fail(const char*why);
+    /// skip spaces and // comment lines
+    void skip_space(void);
+    bool at_end(void);
+    char peek(void);
+    /// consume a null literal if it is next
+    bool accept_null(void);
+    bool begin_object(void);
+    /// give the next key, or false at the closing brace or on error
+    bool next_member(std::string_view& key);
+    bool begin_array(void);
+    /// true if another element follows, false at the closing bracket or on error
+    bool next_element(void);
+    bool read_string(std::string& str);
+    /// the view is valid till the next read
+    bool read_string_view(std::string_view& sv);
+    bool read_int64(int64_t& i);
+    bool read_double(double& d);
+    bool read_bool(bool& b);
+    bool skip_value(void);
+    /// skip the next value, giving its exact text
+    bool raw_value(std::string_view& raw);
+};
+
+
+/// appends compact JSON text to a string
+class json_writer
+{
+    std::string& jw_out;
+    std::vector<bool> jw_first;
+    bool jw_afterkey;
+    void separate(void);
+    void append_quoted(std::string_view s);
+public:
+    explicit json_writer(std::string& out)
+        : jw_out(out), jw_first(), jw_afterkey(false) {};
+    void begin_object(void);
+    void key(std::string_view k);
+    void end_object(void);
+    void begin_array(void);
+    void end_array(void);
+    void write_null(void);
+    void write_bool(bool b);
+    void write_int(int64_t i);
+    void write_double(double d);
+    void write_string(std::string_view s);
+    /// append some already valid JSON text
+    void write_raw(std::string_view raw);
+};
+
+
+/// one member of a struct known in JSON
+template<typename Cls, typename Mem>
+struct json_field
+{
+    const char* jf_name;
+    Mem Cls::* jf_ptr;
+};
+
+template<typename Cls, typename Mem>
+constexpr json_field<Cls,Mem>
+make_json_field(const char*name, Mem Cls::* ptr)
+{
+    return json_field<Cls,Mem> {name, ptr};
+}
+
+#define FRPS_JSON_FIELD(Cls,Mem) make_json_field(#Mem, &Cls::Mem)
+
+template<typename T, typename = void>
+struct has_json_fields : std::false_type {};
+
+template<typename T>
+struct has_json_fields<T, std::void_t<decltype(T::json_fields())>> : std::true_type {};
+
+
+/// decoders, returning false on errors
+extern bool json_decode(json_reader& rd, std::string& s);
+extern bool json_decode(json_reader& rd, int64_t& i);
+extern bool json_decode(json_reader& rd, int& i);
+extern bool json_decode(json_reader& rd, double& d);
+extern bool json_decode(json_reader& rd, bool& b);
+/// the generic fallback, which builds a Json::Value
+extern bool json_decode(json_reader& rd, Json::Value& jv);
+/// allocated in the arena of the reader
+extern bool json_decode(json_reader& rd, std::pmr::string& s);
+template<typename T> bool json_decode(json_reader& rd, std::pmr::vector<T>& vec);
+template<typename T> bool json_decode(json_reader& rd, std::vector<T>& vec);
+template<typename T> bool json_decode(json_reader& rd, std::optional<T>& opt);
+template<typename T>
+std::enable_if_t<has_json_fields<T>::value, bool> json_decode(json_reader& rd, T& obj);
+
+/// encoders
+extern void json_encode(json_writer& wr, const std::string& s);
+extern void json_encode(json_writer& wr, int64_t i);
+extern void json_encode(json_writer& wr, int i);
+extern void json_encode(json_writer& wr, double d);
+extern void json_encode(json_writer& wr, bool b);
+extern void json_encode(json_writer& wr, const Json::Value& jv);
+extern void json_encode(json_writer& wr, const std::pmr::string& s);
+template<typename T> void json_encode(json_writer& wr, const std::pmr::vector<T>& vec);
+template<typename T> void json_encode(json_writer& wr, const std::vector<T>& vec);
+template<typename T> void json_encode(json_writer& wr, const std::optional<T>& opt);
+template<typename T>
+std::enable_if_t<has_json_fields<T>::value> json_encode(json_writer& wr, const T& obj);
+
+typedef std::pmr::polymorphic_allocator<char> json_allocator_t;
+
+/// build a T by uses-allocator construction from the arena, when T is
+/// allocator-aware; decoders then keep the allocator of what they fill
+template<typename T>
+T
+json_construct(std::pmr::memory_resource*arena)
+{
+    if constexpr (std::uses_allocator<T, json_allocator_t>::value)
+        {
+            json_allocator_t alloc(arena?arena:std::pmr::get_default_resource());
+            if constexpr (std::is_constructible<T, std::allocator_arg_t, const json_allocator_t&>::value)
+                return T(std::allocator_arg, alloc);
+            else
+                return T(alloc);
+        }
+    else
+        return T {};
+} // end json_construct
+
+template<typename T>
+bool
+json_decode(json_reader& rd, std::pmr::vector<T>& vec)
+{
+    /// elements are built by the allocator of the vector
+    vec.clear();
+    if (!rd.begin_array())
+        return false;
+    while (rd.next_element())
+        {
+            vec.emplace_back();
+            if (!json_decode(rd, vec.back()))
+                return false;
+        };
+    return rd.ok();
+} // end json_decode for arena vectors
+
+template<typename T>
+bool
+json_decode(json_reader& rd, std::vector<T>& vec)
+{
+    vec.clear();
+    if (!rd.begin_array())
+        return false;
+    while (rd.next_element())
+        {
+            vec.emplace_back();
+            if (!json_decode(rd, vec.back()))
+                return false;
+        };
+    return rd.ok();
+} // end json_decode for vectors
+
+template<typename T>
+bool
+json_decode(json_reader& rd, std::optional<T>& opt)
+{
+    if (rd.accept_null())
+        {
+            opt.reset();
+            return true;
+        };
+    opt.emplace();
+    return json_decode(rd, *opt);
+} // end json_decode for optionals
+
+template<typename T>
+std::enable_if_t<has_json_fields<T>::value, bool>
+json_decode(json_reader& rd, T& obj)
+{
+    if (!rd.begin_object())
+        return false;
+    std::string_view key;
+    while (rd.next_member(key))
+        {
+            bool matched = false;
+            bool good = true;
+            std::apply([&](const auto&... fld)
+            {
+                ((!matched && key == fld.jf_name
+                  && (matched = true, good = json_decode(rd, obj.*(fld.jf_ptr)))), ...);
+            }, T::json_fields());
+            if (!matched)
+                good = rd.skip_value();
+            if (!good)
+                return false;
+        };
+    return rd.ok();
+} // end json_decode for structs
+
+template<typename T>
+void
+json_encode(json_writer& wr, const std::pmr::vector<T>& vec)
+{
+    wr.begin_array();
+    for (const T& elem: vec)
+        json_encode(wr, elem);
+    wr.end_array();
+} // end json_encode for arena vectors
+
+template<typename T>
+void
+json_encode(json_writer& wr, const std::vector<T>& vec)
+{
+    wr.begin_array();
+    for (const T& elem: vec)
+        json_encode(wr, elem);
+    wr.end_array();
+} // end json_encode for vectors
+
+template<typename T>
+void
+json_encode(json_writer& wr, const std::optional<T>& opt)
+{
+    if (opt)
+        json_encode(wr, *opt);
+    else
+        wr.write_null();
+} // end json_encode for optionals
+
+template<typename T>
+std::enable_if_t<has_json_fields<T>::value>
+json_encode(json_writer& wr, const T& obj)
+{
+    wr.begin_object();
+    std::apply([&](const auto&... fld)
+    {
+        ((wr.key(fld.jf_name), json_encode(wr, obj.*(fld.jf_ptr))), ...);
+    }, T::json_fields());
+    wr.end_object();
+} // end json_encode for structs
+
+/// copy data decoded in a message arena, to keep it after the message;
+/// a plain copy of any std::pmr container already leaves the arena
+template<typename T>
+T
+json_promote(const T& x)
+{
+    return x;
+} // end json_promote
+
+inline std::string
+json_promote(const std::pmr::string& s)
+{
+    return std::string(s.data(), s.size());
+} // end json_promote for strings
+
+template<typename T>
+auto
+json_promote(const std::pmr::vector<T>& vec)
+{
+    std::vector<decltype(json_promote(std::declval<const T&>()))> res;
+    res.reserve(vec.size());
+    for (const T& elem: vec)
+        res.push_back(json_promote(elem));
+    return res;
+} // end json_promote for vectors
+
+/// find the string member key of the JSON object text, without decoding the rest
+extern bool json_string_member(std::string_view objtext, std::string_view key, std::string& val,
+                               std::pmr::memory_resource*arena = nullptr);
+
+
+/// a JSONRPC method, with its params and result types
+template<typename Params, typename Result>
+struct json_method
+{
+    typedef Params params_type;
+    typedef Result result_type;
+    const char* jm_name;
+};
+
+/// handles the params of some incoming request, writing its result
+typedef std::function<bool(connection_st*conn, json_reader& params, json_writer& result)> json_method_handler_t;
+extern void register_json_method_handler(const char*method, json_method_handler_t handler);
+
+/* Handle a request from RefPerSys with typed params and result.  The
+   function fun(connection_st*, const Params&, Result&) returns false
+   on failure, and RefPerSys then gets an error reply. */
+template<typename Params, typename Result, typename Fun>
+void
+register_json_method(const json_method<Params,Result>& meth, Fun fun)
+{
+    register_json_method_handler(meth.jm_name,
+                                 [=](connection_st*conn, json_reader& rd, json_writer& wr)
+    {
+        Params par = json_construct<Params>(rd.arena());
+        if (!json_decode(rd, par))
+            return false;
+        Result res = json_construct<Result>(rd.arena());
+        if (!fun(conn, par, res))
+            return false;
+        json_encode(wr, res);
+        return true;
+    });
+} // end register_json_method
+
+/* Send a typed request to RefPerSys, and call fun(connection_st*,
+   const Result&) when its reply comes, or failure when RefPerSys
+   answers with an error.  Return the JSONRPC id of that request. */
+template<typename Params, typename Result, typename Fun>
+long
+json_call(connection_st*conn, const json_method<Params,Result>& meth, const Params& par,
+          Fun fun, json_failure_handler_t failure = nullptr)
+{
+    std::string parbuf;
+    json_writer wr(parbuf);
+    json_encode(wr, par);
+    const char*methname = meth.jm_name;
+    return conn->send_request(methname, parbuf,
+                              [=](connection_st*c, json_reader& rd)
+    {
+        Result res = json_construct<Result>(rd.arena());
+        if (!json_decode(rd, res))
+            {
+                std::clog << progname << " connection#" << c->conn_rank
+                          << " got bad result for " << methname
+                          << ": " << (rd.error()?:"?") << " at " << rd.position() << std::endl;
+                return;
+            };
+        fun(c, res);
+    }, failure);
+} // end json_call
+
+
+/// the JSONRPC messages known by this GUI
+
+struct empty_params_st
+{
+    static constexpr auto json_fields()
+    {
+        return std::tuple<>();
+    };
+};
+
+struct oid_params_st
+{
+    std::string oid;
+    static constexpr auto json_fields()
+    {
+        return std::make_tuple(FRPS_JSON_FIELD(oid_params_st, oid));
+    };
+};
+
+/// in the message arena, so valid only in the reply handler
+struct object_result_st
+{
+    typedef json_allocator_t allocator_type;
+    std::pmr::string oid;
+    std::pmr::string name;
+    std::pmr::string classname;
+    explicit object_result_st(const allocator_type& alloc = {})
+        : oid(alloc), name(alloc), classname(alloc) {};
+    static constexpr auto json_fields()
+    {
+        return std::make_tuple(FRPS_JSON_FIELD(object_result_st, oid),
+                               FRPS_JSON_FIELD(object_result_st, name),
+                               FRPS_JSON_FIELD(object_result_st, classname));
+    };
+};
+
+struct version_result_st
+{
+    std::string gitid;
+    std::string host;
+    int64_t pid;
+    static constexpr auto json_fields()
+    {
+        return std::make_tuple(FRPS_JSON_FIELD(version_result_st, gitid),
+                               FRPS_JSON_FIELD(version_result_st, host),
+                               FRPS_JSON_FIELD(version_result_st, pid));
+    };
+};
+
+struct names_params_st
+{
+    typedef json_allocator_t allocator_type;
+    std::pmr::vector<std::pmr::string> names;
+    explicit names_params_st(const allocator_type& alloc = {})
+        : names(alloc) {};
+    static constexpr auto json_fields()
+    {
+        return std::make_tuple(FRPS_JSON_FIELD(names_params_st, names));
+    };
+};
+
+/// sent to RefPerSys, to get some object by its oid
+constexpr json_method<oid_params_st, object_result_st> rps_get_object_method {"rps_get_object"};
+/// sent by RefPerSys, to get the version of this GUI
+constexpr json_method<empty_params_st, version_result_st> gui_version_method {"gui_version"};
+/// sent by RefPerSys, to give names for completion
+constexpr json_method<names_params_st, empty_params_st> gui_known_names_method {"gui_known_names"};
+
+/// register the handlers of the above requests from RefPerSys
+extern void register_builtin_json_methods(void);
+
+#endif /* JSONRPSFLTK_INCLUDED */
@@ -8,24 +8,36 @@
  *
  **********************************************/
 
-#include "fltkrps.hh"
+#include "jsonrpsfltk.hh"
 
 enum my_long_option_en
 {
     LONGOPT__FIRST= 1000,
     LONGOPT_START,
+    LONGOPT_IO_URING,
+    LONGOPT_IO_STATS,
+    LONGOPT_SESSION,
+    LONGOPT_NO_SESSION,
+    LONGOPT_CHECK_PERSISTORE,
+    LONGOPT_IO_BENCH,
     LONGOPT__LAST
 };
 
 bool do_start_refpersys=false;
+bool do_show_io_stats=false;
+bool do_session=true;
+bool do_check_persistore=false;
+/// the RefPerSys directory given to --check-persistore, if any
+std::string check_persistore_path;
 const char*progname;
 char myhostname[80];
 std::string my_window_title="GUI-Fltk RefPerSys";
 
-std::string fifo_prefix;
-int cmdfifofd= -1, outfifofd= -1;
+/// each --fifo option gives a connection to some RefPerSys process
+std::vector<std::string> fifo_prefixes;
 
 std::vector<std::string> rest_prog_args;
+std::string refpersys_path;
 int preferred_height=333, preferred_width=444;
 float screen_scale= 1.0;
 Fl_Window* main_window;
@@ -88,6 +100,36 @@ static const struct option long_options[] =
         .name=(char*)"start", .has_arg=no_argument, .flag=(int*)nullptr,
         .val=LONGOPT_START
     },
+    ///  --io-uring, to use io_uring for the FIFOs when available
+    {
+        .name=(char*)"io-uring", .has_arg=no_argument, .flag=(int*)nullptr,
+        .val=LONGOPT_IO_URING
+    },
+    ///  --io-stats, to show I/O statistics at exit
+    {
+        .name=(char*)"io-stats", .has_arg=no_argument, .flag=(int*)nullptr,
+        .val=LONGOPT_IO_STATS
+    },
+    ///  --io-bench=<count>, e.g. --io-bench=100000
+    {
+        .name=(char*)"io-bench", .has_arg=required_argument, .flag=(int*)nullptr,
+        .val=LONGOPT_IO_BENCH
+    },
+    ///  --session=<file>, e.g. --session=/tmp/mysession
+    {
+        .name=(char*)"session", .has_arg=required_argument, .flag=(int*)nullptr,
+        .val=LONGOPT_SESSION
+    },
+    ///  --no-session, to neither restore nor save the session snapshot
+    {
+        .name=(char*)"no-session", .has_arg=no_argument, .flag=(int*)nullptr,
+        .val=LONGOPT_NO_SESSION
+    },
+    ///  --check-persistore[=<directory>], e.g. --check-persistore=$HOME/RefPerSys
+    {
+        .name=(char*)"check-persistore", .has_arg=optional_argument, .flag=(int*)nullptr,
+        .val=LONGOPT_CHECK_PERSISTORE
+    },
     ///  --plugin | -P plugin, e.g. --plugin=foo/bar to dlopen
     ///  the plugin foo/bar.so and dlsym in it fltkrps_bar_start, a nullary
     ///  function return true on success...
@@ -172,7 +214,8 @@ show_usage(void)
               << "\t --plugin= | -P<plugin-file>  "
               << "\t\t# plugin (with .so suffix)" << std::endl
               << "\t --fifo= | -F<fifo-prefix>  "
-              << "\t\t# FIFO *.{cmd,out} used to communicate with RefPerSys" << std::endl
+              << "\t\t# FIFO *.{cmd,out} used to communicate with RefPerSys"
+              << " (may be repeated, one window per RefPerSys)" << std::endl
               << "\t --title= | -T<title>  "
               << "\t\t# title of the window" << std::endl
               << "\t --hashstr | -H<string>  "
@@ -181,6 +224,24 @@ show_usage(void)
               << "\t --start               "
               << "\t\t# really start RefPerSys, using FIFO if provided, and other arguments..."
               << std::endl
+              << "\t --io-uring            "
+              << "\t\t# use io_uring for FIFOs if available, else poll"
+              << std::endl
+              << "\t --io-stats            "
+              << "\t\t# show syscalls per message and CPU per MB at exit"
+              << std::endl
+              << "\t --io-bench=<count>    "
+              << "\t\t# serve <count> requests of a fake RefPerSys, measure the FIFO backend and exit"
+              << std::endl
+              << "\t --session=<file>      "
+              << "\t\t# session snapshot, by default $HOME/.guifltkrps-session"
+              << std::endl
+              << "\t --no-session          "
+              << "\t\t# don't restore or save the session snapshot"
+              << std::endl
+              << "\t --check-persistore[=<directory>] "
+              << "\t\t# check in parallel the persistore of RefPerSys (by default of --refpersys) and exit"
+              << std::endl
               << "\t --help | -h                       "
               << "\t\t# give this help" << std::endl
               << "### see also refpersys.org and github.com/RefPerSys/RefPerSys" << std::endl
@@ -303,7 +364,7 @@ parse_program_options (int argc, char*const*argv)
                 break;
                 case 'F': //// --fifo=<fifo-prefix> for {.cmd,.out} to RefPerSys
                 {
-                    fifo_prefix.assign(optarg);
+                    fifo_prefixes.push_back(std::string(optarg));
                 }
                 break;
                 case 'P': //// --plugin=<basepath> #e.g --plugin=$HOME/lib/myplug
@@ -318,6 +379,43 @@ parse_program_options (int argc, char*const*argv)
                     do_start_refpersys= true;
                 };
                 break;
+                case LONGOPT_IO_URING:
+                {
+                    use_io_uring= true;
+                };
+                break;
+                case LONGOPT_IO_STATS:
+                {
+                    do_show_io_stats= true;
+                };
+                break;
+                case LONGOPT_SESSION:
+                {
+                    session_path.assign(optarg);
+                };
+                break;
+                case LONGOPT_NO_SESSION:
+                {
+                    do_session= false;
+                };
+                break;
+                case LONGOPT_IO_BENCH:
+                {
+                    io_bench_count = atol(optarg);
+                    if (io_bench_count <= 0)
+                        {
+                            std::cerr << progname << " bad --io-bench count " << optarg << std::endl;
+                            exit(EXIT_FAILURE);
+                        };
+                };
+                break;
+                case LONGOPT_CHECK_PERSISTORE:
+                {
+                    do_check_persistore= true;
+                    if (optarg)
+                        check_persistore_path.assign(optarg);
+                };
+                break;
                 default:
                     std::clog << progname << ": with unexpected argument: " << optarg << std::endl;
                     exit(EXIT_FAILURE);
@@ -337,8 +435,26 @@ create_main_window(void)
 {
     main_window = new Fl_Window(preferred_height, preferred_width);
     main_window->label(my_window_title.c_str());
+    main_window->end();
 } // end create_main_window
 
+void
+create_connection_window(connection_st*conn)
+{
+    std::string title= my_window_title + " @" + conn->conn_fifo_prefix;
+    conn->conn_window = new Fl_Window(preferred_height, preferred_width);
+    conn->conn_window->copy_label(title.c_str());
+    conn->conn_window->user_data((void*)conn);
+    int winw = conn->conn_window->w(), winh = conn->conn_window->h();
+    conn->conn_statusbox = new fitted_box(0, 0, winw, 24);
+    conn->conn_statusbox->box(FL_FLAT_BOX);
+    conn->show_state();
+    /// only the area below the status line grows with the window
+    Fl_Box* restbox = new Fl_Box(0, 24, winw, winh-24);
+    conn->conn_window->resizable(restbox);
+    conn->conn_window->end();
+} // end create_connection_window
+
 
 bool
 set_refpersys_path(const char*path)
@@ -549,6 +665,7 @@ set_refpersys_path(const char*path)
             }
     };
     std::cout << progname << " using RefPerSys from " << pathstr << " on " << myhostname << " pid " << (int)getpid() << std::endl;
+    refpersys_path = pathstr;
     return true;
 } // end set_refpersys_path
 
@@ -589,42 +706,66 @@ main(int argc, char**argv)
     progname = argv[0];
     memset(myhostname, 0, sizeof(myhostname));
     gethostname(myhostname, sizeof(myhostname)-4);
+    register_builtin_json_methods();
     parse_program_options(argc, argv);
-    fl_open_display();
-    if (!fifo_prefix.empty())
+    if (do_check_persistore)
         {
-            do_create_fifos(fifo_prefix);
-            std::string cmdfifo= fifo_prefix + ".cmd";
-            std::string outfifo= fifo_prefix + ".out";
-            cmdfifofd = open(cmdfifo.c_str(), 0440| R_OK);
-            if (cmdfifofd < 0)
-                {
-                    int e = errno;
-                    std::clog << progname << " pid " << (int)getpid() << " git " << SHORTGIT_ID
-                              << " failed to open command FIFO " << cmdfifo << " for read : " << strerror(e) << std::endl;
-                    exit(EXIT_FAILURE);
-                };
-            Fl::add_fd(outfifofd, FL_READ, out_fd_handler);
-            outfifofd = open(outfifo.c_str(), 0660| W_OK);
-            if (outfifofd < 0)
+            if (check_persistore_path.empty())
+                check_persistore_path = refpersys_path;
+            if (check_persistore_path.empty())
                 {
-                    int e = errno;
-                    std::clog << progname << " pid " << (int)getpid() << " git " << SHORTGIT_ID
-                              << " failed to open output FIFO " << outfifo << " for write : " << strerror(e) << std::endl;
+                    std::cerr << progname << " --check-persistore needs a directory or --refpersys" << std::endl;
                     exit(EXIT_FAILURE);
                 };
-            Fl::add_fd(cmdfifofd, FL_WRITE, cmd_fd_handler);
+            exit(check_persistore(check_persistore_path));
+        };
+    if (io_bench_count > 0)
+        exit(io_benchmark(io_bench_count));
+    fl_open_display();
+    if (use_io_uring && !iouring_start())
+        {
+            std::clog << progname << " using poll for FIFOs, without io_uring" << std::endl;
+            use_io_uring = false;
+        };
+    if (!do_session)
+        session_path.clear();
+    else if (session_path.empty() && getenv("HOME"))
+        session_path = std::string(getenv("HOME")) + "/.guifltkrps-session";
+    completion_start();
+    for (const std::string& prefix: fifo_prefixes)
+        {
+            do_create_fifos(prefix);
+            connection_st* conn = new connection_st(vector_connections.size(), prefix);
+            if (!conn->open_fifos())
+                exit(EXIT_FAILURE);
+            vector_connections.push_back(conn);
         };
     create_main_window();
+    for (connection_st* conn: vector_connections)
+        create_connection_window(conn);
+    /// restored before showing the windows, so they appear at their
+    /// saved places, and the persistore names are indexed after the
+    /// saved ones
+    session_restore();
+    if (!refpersys_path.empty())
+        completion_load_persistore(refpersys_path + "/persistore");
 #warning do_start_refpersys should be used
     main_window->show(argc, argv);
+    for (connection_st* conn: vector_connections)
+        conn->conn_window->show();
+    session_start_autosave();
     std::cout << progname << " running pid " << (int)getpid()
               << " on " << myhostname << " FLTK:" << Fl::abi_version()
               << ", git "
               << SHORTGIT_ID << std::endl
               << ".... built " << __DATE__ "," __TIME__
               << " on " << BUILD_HOST << std::endl;
-    return Fl::run();
+    int runres = Fl::run();
+    session_save();
+    completion_stop();
+    if (do_show_io_stats)
+        show_io_stats();
+    return runres;
 } // end main
 
 /// enf of file progfltk.cc
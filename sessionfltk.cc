@@ -0,0 +1,406 @@
+/**** file guifltk-refpersys/sessionfltk.cc ******
+ ****  SPDX-License-Identifier: MIT ******
+ *
+ * © Copyright 2023 The  Reflective Persistent System Team
+ * team@refpersys.org &   http://refpersys.org/
+ *
+ * contributors: Basile Starynkevitch <basile@starynkevitch.net>
+ *
+ **********************************************/
+
+#include "jsonrpsfltk.hh"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+
+/// set by the --session program option, empty with --no-session
+std::string session_path;
+
+/* The snapshot is position independent: every reference in it is an
+ * offset, so it is used where mmap puts it, without any parsing.  It
+ * starts with a session_header_st, followed by the window table, the
+ * cache table, the pool of strings they refer to, and the names for
+ * completion, each ended by a NUL byte.  Any change of this layout
+ * needs a new frps_session_version. */
+
+static const char frps_session_magic[8] = {'F','R','P','S','S','E','S','S'};
+constexpr uint32_t frps_session_version = 1;
+
+/// some string in the pool
+struct session_ref_st
+{
+    uint32_t sr_off;
+    uint32_t sr_len;
+};
+
+struct session_window_st
+{
+    /// FIFO prefix of the connection, or empty for the main window
+    session_ref_st sw_prefix;
+    int32_t sw_x, sw_y, sw_w, sw_h;
+};
+
+struct session_cacheent_st
+{
+    session_ref_st sc_prefix;
+    session_ref_st sc_oid;
+    session_ref_st sc_json;
+};
+
+struct session_header_st
+{
+    char sh_magic[8];
+    uint32_t sh_version;
+    uint32_t sh_header_size;
+    uint64_t sh_file_size;
+    int64_t sh_time;
+    uint64_t sh_windows_off;
+    uint64_t sh_windows_count;
+    uint64_t sh_cache_off;
+    uint64_t sh_cache_count;
+    uint64_t sh_pool_off;
+    uint64_t sh_pool_size;
+    uint64_t sh_names_off;
+    uint64_t sh_names_size;
+};
+
+/// cached objects asked again to RefPerSys at each tick
+constexpr unsigned frps_revalidate_batch = 32;
+constexpr double frps_revalidate_delay = 0.05;
+
+static connection_st*
+connection_by_prefix(std::string_view prefix)
+{
+    for (connection_st*conn: vector_connections)
+        if (conn && conn->conn_fifo_prefix == prefix)
+            return conn;
+    return nullptr;
+} // end connection_by_prefix
+
+static void
+append_aligned(std::string& buf, const void*data, size_t size)
+{
+    while (buf.size() % alignof(uint64_t))
+        buf.push_back((char)0);
+    buf.append((const char*)data, size);
+} // end append_aligned
+
+/// the state copied by the GUI thread for one snapshot
+struct session_data_st
+{
+    std::string sd_pool;
+    std::vector<session_window_st> sd_windows;
+    std::vector<session_cacheent_st> sd_cachents;
+};
+
+/// true while a snapshot is queued or written
+static std::atomic<bool> session_writing;
+
+/// serialize and write a snapshot, on the completion thread
+static bool
+session_write(const std::string& path, const session_data_st& sd)
+{
+    std::string names;
+    completion_for_each_name([&](std::string_view name)
+    {
+        names.append(name);
+        names.push_back((char)0);
+    });
+    session_header_st hdr;
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy(hdr.sh_magic, frps_session_magic, sizeof(hdr.sh_magic));
+    hdr.sh_version = frps_session_version;
+    hdr.sh_header_size = sizeof(hdr);
+    hdr.sh_time = (int64_t)time(nullptr);
+    std::string buf;
+    buf.reserve(sizeof(hdr) + sd.sd_windows.size()*sizeof(session_window_st)
+                + sd.sd_cachents.size()*sizeof(session_cacheent_st)
+                + sd.sd_pool.size() + names.size() + 32);
+    buf.append((const char*)&hdr, sizeof(hdr));
+    append_aligned(buf, nullptr, 0);
+    hdr.sh_windows_off = buf.size();
+    hdr.sh_windows_count = sd.sd_windows.size();
+    append_aligned(buf, sd.sd_windows.data(), sd.sd_windows.size()*sizeof(session_window_st));
+    append_aligned(buf, nullptr, 0);
+    hdr.sh_cache_off = buf.size();
+    hdr.sh_cache_count = sd.sd_cachents.size();
+    append_aligned(buf, sd.sd_cachents.data(), sd.sd_cachents.size()*sizeof(session_cacheent_st));
+    hdr.sh_pool_off = buf.size();
+    hdr.sh_pool_size = sd.sd_pool.size();
+    buf.append(sd.sd_pool);
+    hdr.sh_names_off = buf.size();
+    hdr.sh_names_size = names.size();
+    buf.append(names);
+    names.clear();
+    names.shrink_to_fit();
+    hdr.sh_file_size = buf.size();
+    memcpy(&buf[0], &hdr, sizeof(hdr));
+    /// write a unique temporary file then rename it, so a crash keeps
+    /// the old snapshot and two GUIs sharing it do not mix their files
+    std::string tmppath = path + ".XXXXXX";
+    int fd = mkostemp(&tmppath[0], O_CLOEXEC);
+    if (fd < 0)
+        {
+            std::clog << progname << " cannot create session snapshot " << tmppath
+                      << " :" << strerror(errno) << std::endl;
+            return false;
+        };
+    size_t done = 0;
+    while (done < buf.size())
+        {
+            ssize_t nb = write(fd, buf.data() + done, buf.size() - done);
+            if (nb < 0 && errno == EINTR)
+                continue;
+            if (nb <= 0)
+                {
+                    std::clog << progname << " cannot write session snapshot " << tmppath
+                              << " :" << strerror(errno) << std::endl;
+                    close(fd);
+                    unlink(tmppath.c_str());
+                    return false;
+                };
+            done += nb;
+        };
+    close(fd);
+    if (rename(tmppath.c_str(), path.c_str()))
+        {
+            std::clog << progname << " cannot rename session snapshot to " << path
+                      << " :" << strerror(errno) << std::endl;
+            unlink(tmppath.c_str());
+            return false;
+        };
+    return true;
+} // end session_write
+
+/* The GUI thread only copies the windows and the object caches, which
+ * are bounded by frps_session_cache_budget; the names, possibly
+ * millions, are copied, serialized and written on the completion
+ * thread. */
+bool
+session_save(void)
+{
+    if (session_path.empty())
+        return false;
+    auto sd = std::make_shared<session_data_st>();
+    auto intern = [&](std::string_view s)
+    {
+        session_ref_st r {(uint32_t)sd->sd_pool.size(), (uint32_t)s.size()};
+        sd->sd_pool.append(s);
+        return r;
+    };
+    if (main_window)
+        sd->sd_windows.push_back(session_window_st {{0,0}, main_window->x(), main_window->y(),
+                                                    main_window->w(), main_window->h()
+                                                   });
+    /// the most recently used objects of all connections fill the budget
+    struct cacheuse_st
+    {
+        long cu_stamp;
+        session_ref_st cu_prefix;
+        const std::string* cu_oid;
+        const cached_object_st* cu_obj;
+    };
+    std::vector<cacheuse_st> cacheuses;
+    for (connection_st*conn: vector_connections)
+        {
+            if (!conn)
+                continue;
+            session_ref_st prefref = intern(conn->conn_fifo_prefix);
+            Fl_Window*win = conn->conn_window;
+            if (win)
+                sd->sd_windows.push_back(session_window_st {prefref, win->x(), win->y(), win->w(), win->h()});
+            for (auto& ent: conn->conn_objcache)
+                cacheuses.push_back(cacheuse_st {ent.second.co_stamp, prefref, &ent.first, &ent.second});
+        };
+    std::sort(cacheuses.begin(), cacheuses.end(),
+              [](const cacheuse_st& a, const cacheuse_st& b)
+    {
+        return a.cu_stamp > b.cu_stamp;
+    });
+    size_t cachebytes = 0;
+    for (const cacheuse_st& cu: cacheuses)
+        {
+            cachebytes += cu.cu_oid->size() + cu.cu_obj->co_json.size();
+            if (cachebytes > frps_session_cache_budget)
+                break;
+            session_ref_st oidref = intern(*cu.cu_oid);
+            sd->sd_cachents.push_back(session_cacheent_st {cu.cu_prefix, oidref, intern(cu.cu_obj->co_json)});
+        };
+    session_writing = true;
+    std::string path = session_path;
+    completion_run_job([path, sd]()
+    {
+        session_write(path, *sd);
+        session_writing = false;
+    });
+    return true;
+} // end session_save
+
+/// ask RefPerSys again for the cached objects restored from the snapshot
+static void
+session_revalidate(void*data)
+{
+    connection_st*conn = (connection_st*)data;
+    /// requests to a RefPerSys not yet reading are kept in conn_outbuf
+    if (!conn || conn->conn_state == CONNSTATE_DISCONNECTED)
+        return;
+    for (unsigned nb = 0; nb < frps_revalidate_batch && !conn->conn_stale_oids.empty(); nb++)
+        {
+            auto it = conn->conn_stale_oids.begin();
+            oid_params_st par {*it};
+            std::string oid = *it;
+            conn->conn_stale_oids.erase(it);
+            /// the reply refreshes the object cache in process_message,
+            /// an error (e.g. a deleted object) removes it from the cache
+            json_call(conn, rps_get_object_method, par,
+                      [](connection_st*, const object_result_st&) {},
+                      [oid](connection_st*c, const std::string&)
+            {
+                c->conn_objcache.erase(oid);
+            });
+        };
+    if (!conn->conn_stale_oids.empty())
+        Fl::repeat_timeout(frps_revalidate_delay, session_revalidate, data);
+} // end session_revalidate
+
+bool
+session_restore(void)
+{
+    if (session_path.empty())
+        return false;
+    int fd = open(session_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        {
+            if (errno != ENOENT)
+                std::clog << progname << " cannot open session snapshot " << session_path
+                          << " :" << strerror(errno) << std::endl;
+            return false;
+        };
+    struct stat st;
+    memset (&st, 0, sizeof(st));
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(session_header_st))
+        {
+            close(fd);
+            std::clog << progname << " ignoring too short session snapshot " << session_path << std::endl;
+            return false;
+        };
+    size_t size = st.st_size;
+    void*ad = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ad == MAP_FAILED)
+        {
+            std::clog << progname << " cannot mmap session snapshot " << session_path
+                      << " :" << strerror(errno) << std::endl;
+            return false;
+        };
+    std::shared_ptr<const char> map((const char*)ad, [size](const char*p)
+    {
+        munmap((void*)p, size);
+    });
+    const session_header_st*hdr = (const session_header_st*)ad;
+    auto inside = [size](uint64_t off, uint64_t len)
+    {
+        return off <= size && len <= size - off;
+    };
+    if (memcmp(hdr->sh_magic, frps_session_magic, sizeof(hdr->sh_magic))
+            || hdr->sh_version != frps_session_version
+            || hdr->sh_header_size != sizeof(session_header_st)
+            || hdr->sh_file_size != size
+            || hdr->sh_windows_off % alignof(session_window_st)
+            || hdr->sh_cache_off % alignof(session_cacheent_st)
+            || hdr->sh_windows_count > size || hdr->sh_cache_count > size
+            || !inside(hdr->sh_windows_off, hdr->sh_windows_count*sizeof(session_window_st))
+            || !inside(hdr->sh_cache_off, hdr->sh_cache_count*sizeof(session_cacheent_st))
+            || !inside(hdr->sh_pool_off, hdr->sh_pool_size)
+            || !inside(hdr->sh_names_off, hdr->sh_names_size))
+        {
+            std::clog << progname << " ignoring invalid or old session snapshot " << session_path << std::endl;
+            return false;
+        };
+    const char*pool = map.get() + hdr->sh_pool_off;
+    auto poolstr = [&](const session_ref_st& r, std::string_view& sv)
+    {
+        if (r.sr_off > hdr->sh_pool_size || r.sr_len > hdr->sh_pool_size - r.sr_off)
+            return false;
+        sv = std::string_view(pool + r.sr_off, r.sr_len);
+        return true;
+    };
+    const session_window_st*windows = (const session_window_st*)(map.get() + hdr->sh_windows_off);
+    for (uint64_t ix = 0; ix < hdr->sh_windows_count; ix++)
+        {
+            const session_window_st& sw = windows[ix];
+            std::string_view prefix;
+            if (!poolstr(sw.sw_prefix, prefix))
+                continue;
+            Fl_Window*win = main_window;
+            if (!prefix.empty())
+                {
+                    connection_st*conn = connection_by_prefix(prefix);
+                    win = conn?conn->conn_window:nullptr;
+                };
+            if (win && sw.sw_w >= 100 && sw.sw_h >= 64 && sw.sw_w <= 8192 && sw.sw_h <= 8192)
+                win->resize(sw.sw_x, sw.sw_y, sw.sw_w, sw.sw_h);
+        };
+    const session_cacheent_st*cachents = (const session_cacheent_st*)(map.get() + hdr->sh_cache_off);
+    long nbstale = 0;
+    /// the most recently used objects come first, so are cached last
+    for (uint64_t ix = hdr->sh_cache_count; ix-- > 0; )
+        {
+            const session_cacheent_st& sc = cachents[ix];
+            std::string_view prefix, oid, json;
+            if (!poolstr(sc.sc_prefix, prefix) || !poolstr(sc.sc_oid, oid) || !poolstr(sc.sc_json, json))
+                continue;
+            connection_st*conn = connection_by_prefix(prefix);
+            if (!conn || oid.empty())
+                continue;
+            std::string oidstr(oid);
+            if (conn->conn_objcache.find(oidstr) == conn->conn_objcache.end())
+                {
+                    conn->cache_object(oidstr, std::string(json));
+                    conn->conn_stale_oids.insert(oidstr);
+                    nbstale++;
+                };
+        };
+    /// names are indexed from the mapping by the completion thread,
+    /// which keeps it mapped till then
+    completion_add_name_pool(std::shared_ptr<const char>(map, map.get() + hdr->sh_names_off),
+                             hdr->sh_names_size);
+    for (connection_st*conn: vector_connections)
+        if (conn && !conn->conn_stale_oids.empty())
+            Fl::add_timeout(0.0, session_revalidate, (void*)conn);
+    char timbuf[64];
+    memset (timbuf, 0, sizeof(timbuf));
+    time_t savedtime = (time_t)hdr->sh_time;
+    struct tm savedtm;
+    memset (&savedtm, 0, sizeof(savedtm));
+    /// a corrupted time may be out of the range of localtime_r
+    if (localtime_r(&savedtime, &savedtm))
+        strftime(timbuf, sizeof(timbuf), "%Y-%b-%d %H:%M:%S", &savedtm);
+    else
+        snprintf(timbuf, sizeof(timbuf), "at unknown time %lld", (long long)hdr->sh_time);
+    std::clog << progname << " restored session from " << session_path
+              << " saved " << timbuf << " with " << nbstale << " cached objects to revalidate"
+              << std::endl;
+    return true;
+} // end session_restore
+
+static void
+session_autosave(void*)
+{
+    /// a slow disk should not pile up snapshots
+    if (!session_writing)
+        session_save();
+    Fl::repeat_timeout(frps_session_period, session_autosave);
+} // end session_autosave
+
+void
+session_start_autosave(void)
+{
+    if (session_path.empty())
+        return;
+    Fl::add_timeout(frps_session_period, session_autosave);
+} // end session_start_autosave
+
+/// end of file sessionfltk.cc
@@ -0,0 +1,200 @@
+/**** file guifltk-refpersys/textfltk.cc ******
+ ****  SPDX-License-Identifier: MIT ******
+ *
+ * © Copyright 2023 The  Reflective Persistent System Team
+ * team@refpersys.org &   http://refpersys.org/
+ *
+ * contributors: Basile Starynkevitch <basile@starynkevitch.net>
+ *
+ **********************************************/
+
+#include "fltkrps.hh"
+
+#include <FL/fl_draw.H>
+
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+
+/// the ellipsis character U+2026 in UTF-8
+static const char text_ellipsis[] = "\xe2\x80\xa6";
+
+struct text_key_st
+{
+    int64_t tk_h0, tk_h1;
+    int tk_len;
+    Fl_Font tk_font;
+    Fl_Fontsize tk_size;
+    bool operator == (const text_key_st&k) const
+    {
+        return tk_h0 == k.tk_h0 && tk_h1 == k.tk_h1 && tk_len == k.tk_len
+               && tk_font == k.tk_font && tk_size == k.tk_size;
+    };
+};
+
+struct text_key_hash
+{
+    size_t operator () (const text_key_st&k) const
+    {
+        return (size_t)(k.tk_h0 ^ (k.tk_h1 * 31) ^ ((int64_t)k.tk_font << 40) ^ ((int64_t)k.tk_size << 24));
+    };
+};
+
+struct text_entry_st
+{
+    text_key_st te_key;
+    /// the text itself, since short strings often have the same hash
+    std::string te_text;
+    std::shared_ptr<const text_layout_st> te_layout;
+    size_t te_bytes;
+};
+
+/// the most recently used entry is in front
+static std::list<text_entry_st> text_lru;
+static std::unordered_map<text_key_st, std::list<text_entry_st>::iterator, text_key_hash> text_cache;
+static size_t text_cache_bytes;
+static float text_cache_scale;
+
+static void
+text_cache_clear(void)
+{
+    text_cache.clear();
+    text_lru.clear();
+    text_cache_bytes = 0;
+} // end text_cache_clear
+
+static std::shared_ptr<const text_layout_st>
+measure_text(const char*str, int len)
+{
+    auto tl = std::make_shared<text_layout_st>();
+    std::string buf(str, len);
+    int w = 0, h = 0;
+    /// the whole text, with the kerning and shaping of fl_draw
+    fl_measure(buf.c_str(), w, h, 0);
+    tl->tl_width = w;
+    tl->tl_height = fl_height();
+    tl->tl_ellipsis_width = (int)(fl_width(text_ellipsis) + 0.5);
+    tl->tl_len = len;
+    tl->tl_fit_maxwidth = -1;
+    tl->tl_fit_len = len;
+    return tl;
+} // end measure_text
+
+std::shared_ptr<const text_layout_st>
+text_layout(const char*str, int len)
+{
+    if (!str)
+        str = "";
+    if (len < 0)
+        len = strlen(str);
+    if (text_cache_scale != screen_scale)
+        {
+            text_cache_clear();
+            text_cache_scale = screen_scale;
+        };
+    int64_t ht[2] = {0,0};
+    /// empty text is not cached
+    if (rps_compute_cstr_two_64bits_hash(ht, str, len) <= 0)
+        return measure_text(str, len);
+    text_key_st key {ht[0], ht[1], len, fl_font(), fl_size()};
+    auto it = text_cache.find(key);
+    if (it != text_cache.end())
+        {
+            auto lit = it->second;
+            if (lit->te_text.size() == (size_t)len && !memcmp(lit->te_text.data(), str, len))
+                {
+                    text_lru.splice(text_lru.begin(), text_lru, lit);
+                    return lit->te_layout;
+                };
+            /// same hash for another text, which replaces it
+            text_cache_bytes -= lit->te_bytes;
+            text_lru.erase(lit);
+            text_cache.erase(it);
+        };
+    auto tl = measure_text(str, len);
+    size_t bytes = sizeof(text_entry_st) + sizeof(text_layout_st) + len;
+    text_lru.push_front(text_entry_st {key, std::string(str, len), tl, bytes});
+    text_cache[key] = text_lru.begin();
+    text_cache_bytes += bytes;
+    while (text_cache_bytes > frps_text_cache_budget && text_lru.size() > 1)
+        {
+            text_entry_st& old = text_lru.back();
+            text_cache_bytes -= old.te_bytes;
+            text_cache.erase(old.te_key);
+            text_lru.pop_back();
+        };
+    return tl;
+} // end text_layout
+
+int
+text_fit_length(const char*str, const text_layout_st&tl, int maxwidth)
+{
+    if (tl.tl_width <= maxwidth)
+        return tl.tl_len;
+    if (tl.tl_fit_maxwidth == maxwidth)
+        return tl.tl_fit_len;
+    /// the prefixes ending at UTF-8 character bounds are measured whole,
+    /// as fl_draw draws them, by a binary search on their widths
+    std::vector<int> bounds;
+    const char*end = str + tl.tl_len;
+    for (const char*pc = str; pc < end; )
+        {
+            ucs4_t uc = 0;
+            int l = u8_mbtouc(&uc, (const uint8_t*)pc, end - pc);
+            if (l <= 0)
+                break;
+            bounds.push_back(pc - str);
+            pc += l;
+        };
+    int avail = maxwidth - tl.tl_ellipsis_width;
+    /// the empty prefix fits, the whole text does not
+    size_t lo = 0, hi = bounds.size();
+    while (hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (fl_width(str, bounds[mid]) <= avail)
+                lo = mid;
+            else
+                hi = mid;
+        };
+    tl.tl_fit_maxwidth = maxwidth;
+    tl.tl_fit_len = bounds.empty()?0:bounds[lo];
+    return tl.tl_fit_len;
+} // end text_fit_length
+
+void
+draw_fitted_text(const char*str, int x, int y, int maxwidth)
+{
+    if (!str)
+        return;
+    int len = strlen(str);
+    auto tl = text_layout(str, len);
+    int fitlen = text_fit_length(str, *tl, maxwidth);
+    if (fitlen >= len)
+        {
+            fl_draw(str, len, x, y);
+            return;
+        };
+    std::string buf(str, fitlen);
+    buf.append(text_ellipsis);
+    fl_draw(buf.c_str(), buf.size(), x, y);
+} // end draw_fitted_text
+
+void
+fitted_box::draw(void)
+{
+    draw_box();
+    const char*lab = label();
+    if (!lab || !lab[0])
+        return;
+    int dx = Fl::box_dx(box()) + 3;
+    int dy = Fl::box_dy(box());
+    int maxwidth = w() - Fl::box_dw(box()) - 6;
+    fl_font(labelfont(), labelsize());
+    fl_color(active_r() ? labelcolor() : fl_inactive(labelcolor()));
+    fl_push_clip(x() + dx, y() + dy, maxwidth, h() - Fl::box_dh(box()));
+    draw_fitted_text(lab, x() + dx, y() + (h() + fl_height())/2 - fl_descent(), maxwidth);
+    fl_pop_clip();
+} // end fitted_box::draw
+
+/// end of file textfltk.cc